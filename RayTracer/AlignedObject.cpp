@@ -9,30 +9,37 @@
 #define _aligned_free(ptr) free(ptr)
 #endif
 
-void* AlignedObject::operator new(size_t size)
+void* alignedAllocate(size_t size, size_t alignment)
 {
-	auto storage = _aligned_malloc(size, 16);
+	// aligned_alloc needs the size to be a multiple of the alignment
+	auto storage = _aligned_malloc((size + alignment - 1) & ~(alignment - 1), alignment);
 	if (storage == nullptr)
 		throw std::bad_alloc();
 
 	return storage;
 }
 
-void* AlignedObject::operator new[](size_t size)
+void alignedFree(void* data)
 {
-	auto storage = _aligned_malloc(size, 16);
-	if (storage == nullptr)
-		throw std::bad_alloc();
+	_aligned_free(data);
+}
 
-	return storage;
+void* AlignedObject::operator new(size_t size)
+{
+	return alignedAllocate(size, 16);
+}
+
+void* AlignedObject::operator new[](size_t size)
+{
+	return alignedAllocate(size, 16);
 }
 
 void AlignedObject::operator delete(void* data)
 {
-	_aligned_free(data);
+	alignedFree(data);
 }
 
 void AlignedObject::operator delete[](void* data)
 {
-	_aligned_free(data);
+	alignedFree(data);
 }
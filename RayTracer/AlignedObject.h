@@ -1,10 +1,52 @@
 #pragma once
 #include <cstring>
 
+// Memory aligned to alignment bytes, which must be a power of two. Throws std::bad_alloc when out of memory
+void* alignedAllocate(size_t size, size_t alignment);
+void alignedFree(void* data);
+
 struct alignas(16) AlignedObject
 {
 	void* operator new(size_t);
 	void* operator new[](size_t);
 	void operator delete(void*);
 	void operator delete[](void*);
-};
\ No newline at end of file
+};
+
+// Standard library allocator giving cache line aligned storage, for arrays of aligned types walked in order
+template<typename T>
+struct AlignedAllocator
+{
+	static constexpr size_t ALIGNMENT = 64;
+
+	using value_type = T;
+
+	AlignedAllocator() = default;
+
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U>&)
+	{
+	}
+
+	T* allocate(size_t count)
+	{
+		return static_cast<T*>(alignedAllocate(count * sizeof(T), ALIGNMENT));
+	}
+
+	void deallocate(T* data, size_t)
+	{
+		alignedFree(data);
+	}
+};
+
+template<typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+	return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+	return false;
+}
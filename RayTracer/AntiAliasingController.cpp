@@ -8,6 +8,14 @@ const char* antiAliasingModeToString(AntiAliasingMode mode)
 		return "None";
 	case AntiAliasingMode::Regular:
 		return "Regular";
+	case AntiAliasingMode::Adaptive:
+		return "Adaptive";
+	case AntiAliasingMode::Jittered:
+		return "Jittered";
+	case AntiAliasingMode::Halton:
+		return "Halton";
+	case AntiAliasingMode::Sobol:
+		return "Sobol";
 	default:
 		return "Unknown";
 	}
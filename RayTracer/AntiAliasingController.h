@@ -4,6 +4,10 @@ enum class AntiAliasingMode
 {
 	None,
 	Regular,
+	Adaptive,
+	Jittered,
+	Halton,
+	Sobol,
 
 	Last
 };
@@ -12,6 +16,12 @@ struct AntiAliasingController
 {
 	AntiAliasingMode mode;
 	int sampleDivision;
+	// Adaptive: largest difference in any colour channel between samples before they are subdivided
+	float threshold = 0.1f;
+	// Adaptive: most extra rays traced for one pixel
+	int sampleBudget = 64;
+	// Jittered, Halton and Sobol: mixed into every pixel's random stream, the same seed always gives the same image
+	unsigned int seed = 0;
 };
 
 const char* antiAliasingModeToString(AntiAliasingMode mode);
\ No newline at end of file
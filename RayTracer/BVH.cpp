@@ -0,0 +1,167 @@
+#include "BVH.h"
+
+#include <algorithm>
+
+static constexpr int BIN_COUNT = 16;
+static constexpr int MAX_LEAF_SIZE = 8;
+// Cost of visiting a node relative to intersecting a primitive
+static constexpr float TRAVERSAL_COST = 0.5f;
+
+struct BVH::BuildPrimitive
+{
+	BoundingBox bounds;
+	vec4 centre;
+	int index;
+};
+
+void BVH::build(const std::vector<BoundingBox>& primitiveBounds)
+{
+	clear();
+
+	if (primitiveBounds.empty())
+		return;
+
+	const auto numberPrimitives = static_cast<int>(primitiveBounds.size());
+
+	std::vector<BuildPrimitive> buildPrimitives(numberPrimitives);
+	for (auto i = 0; i < numberPrimitives; i++)
+	{
+		// Pad the bounds so flat primitives such as polygons do not give zero width slabs
+		const auto& bounds = primitiveBounds[i];
+		const auto padding = (bounds.maximum - bounds.minimum) * 1.0e-4f + 1.0e-4f;
+
+		buildPrimitives[i].bounds = BoundingBox{ bounds.minimum - padding, bounds.maximum + padding };
+		buildPrimitives[i].centre = buildPrimitives[i].bounds.centre();
+		buildPrimitives[i].index = i;
+	}
+
+	nodes.reserve(numberPrimitives * 2 - 1);
+	buildNode(buildPrimitives, 0, numberPrimitives, 0);
+
+	primitives.resize(numberPrimitives);
+	for (auto i = 0; i < numberPrimitives; i++)
+		primitives[i] = buildPrimitives[i].index;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	primitives.clear();
+}
+
+int BVH::buildNode(std::vector<BuildPrimitive>& buildPrimitives, int begin, int end, int depth)
+{
+	const auto nodeIndex = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+
+	BoundingBox bounds{};
+	BoundingBox centreBounds{};
+	for (auto i = begin; i < end; i++)
+	{
+		bounds.extend(buildPrimitives[i].bounds);
+		centreBounds.extend(buildPrimitives[i].centre);
+	}
+
+	nodes[nodeIndex].bounds = bounds;
+	nodes[nodeIndex].offset = begin;
+	nodes[nodeIndex].count = end - begin;
+
+	const auto count = end - begin;
+	if (count == 1 || depth >= MAX_DEPTH - 1)
+		return nodeIndex;
+
+	const auto extent = centreBounds.maximum - centreBounds.minimum;
+	auto axis = 0;
+	if (extent.y > extent[axis])
+		axis = 1;
+	if (extent.z > extent[axis])
+		axis = 2;
+
+	auto middle = begin;
+	if (extent[axis] <= 0)
+	{
+		// All centres coincide, no split will separate them
+		if (count <= MAX_LEAF_SIZE)
+			return nodeIndex;
+
+		middle = begin + count / 2;
+	}
+	else
+	{
+		const auto axisMinimum = centreBounds.minimum[axis];
+		const auto binScale = BIN_COUNT / extent[axis];
+		auto binIndex = [axis, axisMinimum, binScale](const BuildPrimitive& primitive)
+		{
+			return std::min(static_cast<int>((primitive.centre[axis] - axisMinimum) * binScale), BIN_COUNT - 1);
+		};
+
+		BoundingBox binBounds[BIN_COUNT];
+		int binCounts[BIN_COUNT]{};
+		for (auto i = begin; i < end; i++)
+		{
+			const auto bin = binIndex(buildPrimitives[i]);
+			binBounds[bin].extend(buildPrimitives[i].bounds);
+			binCounts[bin]++;
+		}
+
+		// Sweep from the right to get the area and count of every right hand side
+		float rightAreas[BIN_COUNT];
+		int rightCounts[BIN_COUNT];
+		BoundingBox rightBounds{};
+		auto rightCount = 0;
+		for (auto i = BIN_COUNT - 1; i > 0; i--)
+		{
+			rightBounds.extend(binBounds[i]);
+			rightCount += binCounts[i];
+			rightAreas[i] = rightBounds.surfaceArea();
+			rightCounts[i] = rightCount;
+		}
+
+		auto bestCost = std::numeric_limits<float>::infinity();
+		auto bestSplit = 0;
+		BoundingBox leftBounds{};
+		auto leftCount = 0;
+		for (auto i = 1; i < BIN_COUNT; i++)
+		{
+			leftBounds.extend(binBounds[i - 1]);
+			leftCount += binCounts[i - 1];
+			if (leftCount == 0 || rightCounts[i] == 0)
+				continue;
+
+			const auto cost = leftBounds.surfaceArea() * leftCount + rightAreas[i] * rightCounts[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = i;
+			}
+		}
+
+		bestCost = TRAVERSAL_COST + bestCost / bounds.surfaceArea();
+		if (count <= MAX_LEAF_SIZE && bestCost >= count)
+			return nodeIndex;
+
+		if (bestSplit != 0)
+		{
+			middle = static_cast<int>(std::partition(buildPrimitives.begin() + begin, buildPrimitives.begin() + end, [&binIndex, bestSplit](const BuildPrimitive& primitive)
+			{
+				return binIndex(primitive) < bestSplit;
+			}) - buildPrimitives.begin());
+		}
+
+		if (middle == begin || middle == end)
+		{
+			middle = begin + count / 2;
+			std::nth_element(buildPrimitives.begin() + begin, buildPrimitives.begin() + middle, buildPrimitives.begin() + end, [axis](const BuildPrimitive& lhs, const BuildPrimitive& rhs)
+			{
+				return lhs.centre[axis] < rhs.centre[axis];
+			});
+		}
+	}
+
+	nodes[nodeIndex].count = 0;
+	buildNode(buildPrimitives, begin, middle, depth + 1);
+	const auto right = buildNode(buildPrimitives, middle, end, depth + 1);
+	nodes[nodeIndex].offset = right;
+
+	return nodeIndex;
+}
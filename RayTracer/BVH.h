@@ -0,0 +1,35 @@
+#pragma once
+#include "BoundingBox.h"
+
+#include <vector>
+
+struct BVHNode
+{
+	BoundingBox bounds;
+	// Interior nodes: index of the second child, the first child directly follows its parent
+	// Leaves: index of the first primitive in getPrimitives()
+	int offset;
+	// Number of primitives in a leaf, zero for interior nodes
+	int count;
+};
+
+// Binary bounding volume hierarchy built with the surface area heuristic
+class BVH
+{
+public:
+	static constexpr int MAX_DEPTH = 64;
+
+	void build(const std::vector<BoundingBox>& primitiveBounds);
+	void clear();
+
+	const std::vector<BVHNode>& getNodes() const { return nodes; }
+	const std::vector<int>& getPrimitives() const { return primitives; }
+
+private:
+	struct BuildPrimitive;
+
+	std::vector<BVHNode> nodes{};
+	std::vector<int> primitives{};
+
+	int buildNode(std::vector<BuildPrimitive>& buildPrimitives, int begin, int end, int depth);
+};
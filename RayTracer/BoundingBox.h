@@ -0,0 +1,66 @@
+#pragma once
+#include "AlignedObject.h"
+#include "vec4.h"
+
+#include <limits>
+
+struct alignas(16) BoundingBox : AlignedObject
+{
+	vec4 minimum;
+	vec4 maximum;
+
+	BoundingBox() :
+		minimum{ std::numeric_limits<float>::infinity() },
+		maximum{ -std::numeric_limits<float>::infinity() }
+	{
+	}
+
+	BoundingBox(const vec4& minimum, const vec4& maximum) :
+		minimum{ minimum },
+		maximum{ maximum }
+	{
+	}
+
+	bool isEmpty() const
+	{
+		return minimum.x > maximum.x;
+	}
+
+	void extend(const vec4& point)
+	{
+		minimum = _mm_min_ps(minimum, point);
+		maximum = _mm_max_ps(maximum, point);
+	}
+
+	void extend(const BoundingBox& box)
+	{
+		minimum = _mm_min_ps(minimum, box.minimum);
+		maximum = _mm_max_ps(maximum, box.maximum);
+	}
+
+	vec4 centre() const
+	{
+		return (minimum + maximum) * 0.5f;
+	}
+
+	float surfaceArea() const
+	{
+		if (isEmpty())
+			return 0;
+
+		const auto extent = maximum - minimum;
+		return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+
+	// Distances along the whole line of the ray to where it enters and leaves the box, it misses when entry > exit
+	void slabs(const vec4& position, const vec4& inverseDirection, float& entry, float& exit) const
+	{
+		const vec4 t0 = _mm_mul_ps(_mm_sub_ps(minimum, position), inverseDirection);
+		const vec4 t1 = _mm_mul_ps(_mm_sub_ps(maximum, position), inverseDirection);
+		const vec4 tNear = _mm_min_ps(t0, t1);
+		const vec4 tFar = _mm_max_ps(t0, t1);
+
+		entry = std::max(std::max(tNear.x, tNear.y), tNear.z);
+		exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+	}
+};
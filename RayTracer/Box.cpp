@@ -0,0 +1,97 @@
+#include "Box.h"
+
+#include <cmath>
+#include <limits>
+
+// Hits closer than this are taken to be the surface the ray is leaving
+static constexpr float MIN_DISTANCE = 1.0e-4f;
+static constexpr int MAX_INTERNAL_REFLECTIONS = 4;
+
+bool Box::intersect(const Ray& ray, float& distance, int&) const
+{
+	float entry, exit;
+	bounds.slabs(ray.position, 1.0f / ray.direction, entry, exit);
+
+	// Rays starting inside the box hit it where they leave
+	distance = entry >= MIN_DISTANCE ? entry : exit;
+	return entry <= exit && distance >= MIN_DISTANCE;
+}
+
+void Box::calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const
+{
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
+	result.normal = faceNormal(result.point);
+}
+
+__m128 Box::intersectPacket(const RayPacket& packet) const
+{
+	auto entry = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+	auto exit = _mm_set1_ps(std::numeric_limits<float>::infinity());
+	packet.slabs(bounds.minimum, bounds.maximum, entry, exit);
+
+	const auto minDistance = _mm_set1_ps(MIN_DISTANCE);
+	const auto distance = select(_mm_cmpge_ps(entry, minDistance), entry, exit);
+	const auto hit = _mm_and_ps(_mm_cmple_ps(entry, exit), _mm_cmpge_ps(distance, minDistance));
+	return select(hit, distance, _mm_set1_ps(std::numeric_limits<float>::infinity()));
+}
+
+Ray Box::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
+{
+	auto insideDirection = refract(direction, normal, refractivity);
+	auto position = hitPoint;
+	for (auto i = 0;; i++)
+	{
+		float entry, exit;
+		bounds.slabs(position, 1.0f / insideDirection, entry, exit);
+		position = position + insideDirection * exit;
+
+		const auto inwardNormal = -faceNormal(position);
+		const auto outsideDirection = refract(insideDirection, inwardNormal, 1 / refractivity);
+		// Past the critical angle refract gives no direction and the light reflects off the inside of the face,
+		// which the flat parallel faces of a box make common
+		if (lengthSquared(outsideDirection) > 0 || i == MAX_INTERNAL_REFLECTIONS)
+			return Ray{ position, outsideDirection };
+
+		insideDirection = reflect(insideDirection, inwardNormal);
+	}
+}
+
+bool Box::getBounds(BoundingBox& bounds) const
+{
+	bounds = this->bounds;
+	return true;
+}
+
+vec4 Box::getTextureCoordinates(const vec4& hitPoint) const
+{
+	// Each face shows the whole texture, spread over the two axes across it
+	const auto local = toLocal(hitPoint);
+	const auto axis = faceAxis(local);
+	const auto u = local[(axis + 1) % 3] * 0.5f + 0.5f;
+	const auto v = local[(axis + 2) % 3] * 0.5f + 0.5f;
+	return vec4{ u, v, 0, 0 };
+}
+
+vec4 Box::toLocal(const vec4& point) const
+{
+	return (point - bounds.centre()) * 2 / (bounds.maximum - bounds.minimum);
+}
+
+int Box::faceAxis(const vec4& local)
+{
+	auto axis = fabs(local.x) >= fabs(local.y) ? 0 : 1;
+	if (fabs(local.z) > fabs(local[axis]))
+		axis = 2;
+	return axis;
+}
+
+vec4 Box::faceNormal(const vec4& point) const
+{
+	const auto local = toLocal(point);
+	const auto axis = faceAxis(local);
+
+	float normal[4] = { 0, 0, 0, 0 };
+	normal[axis] = local[axis] < 0 ? -1.0f : 1.0f;
+	return vec4{ normal[0], normal[1], normal[2], normal[3] };
+}
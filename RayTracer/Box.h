@@ -0,0 +1,32 @@
+#pragma once
+#include "SceneObject.h"
+
+// Axis aligned box around center, with sides of the lengths in size
+class alignas(16) Box final : public SceneObject
+{
+public:
+	Box(const vec4& center, const vec4& size, std::unique_ptr<Material> material) :
+		SceneObject{ move(material) },
+		bounds{ center - size * 0.5f, center + size * 0.5f }
+	{
+	}
+
+	bool intersect(const Ray& ray, float& distance, int& primitive) const override;
+	void calculateSurface(const Ray& ray, float distance, int primitive, IntersectionResult& result) const override;
+	__m128 intersectPacket(const RayPacket& packet) const override;
+	Ray handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const override;
+
+	PrimitiveType getPrimitiveType() const override { return PrimitiveType::Box; }
+	bool getBounds(BoundingBox& bounds) const override;
+
+	vec4 getTextureCoordinates(const vec4& hitPoint) const override;
+
+private:
+	BoundingBox bounds;
+
+	// Position of a point relative to the box, from -1 to 1 along each axis inside it
+	vec4 toLocal(const vec4& point) const;
+	// Axis of the face closest to a local point, the one it is furthest along
+	static int faceAxis(const vec4& local);
+	vec4 faceNormal(const vec4& point) const;
+};
@@ -2,7 +2,7 @@
 
 #include <exception>
 
-bool Cone::intersect(const Ray& ray, IntersectionResult& result) const
+bool Cone::intersect(const Ray& ray, float& distance, int&) const
 {
 	const auto axis = bottomCenter - vec4{ 0,-1, 0, 0 };
 	const auto theta = normalise(axis);
@@ -21,13 +21,15 @@ bool Cone::intersect(const Ray& ray, IntersectionResult& result) const
 	const auto t1 = static_cast<float>((-b - sqrt(discriminant)) / (2 * a));
 	const auto t2 = static_cast<float>((-b + sqrt(discriminant)) / (2 * a));
 
-	result.distance = t1 < t2 ? t1 : t2;
-	if (result.distance < 0)
-		return false;
+	distance = t1 < t2 ? t1 : t2;
+	return !(distance < 0);
+}
 
-	result.point = ray.calculatePoint(result.distance);
+void Cone::calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const
+{
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
 	result.normal = normalise(result.point - bottomCenter);
-	return true;
 }
 
 Ray Cone::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
@@ -35,6 +37,12 @@ Ray Cone::handleRefraction(const vec4& direction, const vec4& hitPoint, const ve
 	throw std::exception();
 }
 
+bool Cone::getBounds(BoundingBox&) const
+{
+	// The intersection is against an infinite double cone, so it is not limited to the height
+	return false;
+}
+
 vec4 Cone::getTextureCoordinates(const vec4& hitPoint) const
 {
 	throw std::exception();
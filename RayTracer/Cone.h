@@ -12,9 +12,13 @@ public:
 	{
 	}
 
-	bool intersect(const Ray& ray, IntersectionResult& result) const override;
+	bool intersect(const Ray& ray, float& distance, int& primitive) const override;
+	void calculateSurface(const Ray& ray, float distance, int primitive, IntersectionResult& result) const override;
 	Ray handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const override;
 
+	PrimitiveType getPrimitiveType() const override { return PrimitiveType::Cone; }
+	bool getBounds(BoundingBox& bounds) const override;
+
 	vec4 getTextureCoordinates(const vec4& hitPoint) const override;
 
 
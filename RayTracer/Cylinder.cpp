@@ -5,7 +5,7 @@
 
 static const vec4 xzMask{ 1, 0, 1, 0 };
 
-bool Cylinder::intersect(const Ray& ray, IntersectionResult& result) const
+bool Cylinder::intersect(const Ray& ray, float& distance, int&) const
 {
 	const auto xzDirection = normalise(ray.direction * xzMask);
 	const auto difference = (ray.position - bottomCenter) * xzMask;
@@ -42,13 +42,8 @@ bool Cylinder::intersect(const Ray& ray, IntersectionResult& result) const
 			return false;
 
 		// hit the cap
-		result.distance = t0 + (t0 - t0) * (y0 + 1) / (y0 - y1);
-		if (result.distance <= 0)
-			return false;
-
-		result.point = ray.calculatePoint(result.distance);
-		result.normal = vec4{ 0, -1, 0, 0 };
-		return true;
+		distance = t0 + (t0 - t0) * (y0 + 1) / (y0 - y1);
+		return !(distance <= 0);
 	}
 
 	if (y0 >= 0 && y0 <= height)
@@ -57,9 +52,7 @@ bool Cylinder::intersect(const Ray& ray, IntersectionResult& result) const
 		if (t0 <= 0)
 			return false;
 
-		result.distance = t0;
-		result.point = ray.calculatePoint(result.distance);
-		result.normal = normalise((result.point - bottomCenter) * xzMask);
+		distance = t0;
 		return true;
 	}
 
@@ -69,23 +62,38 @@ bool Cylinder::intersect(const Ray& ray, IntersectionResult& result) const
 			return false;
 
 		// hit the cap
-		result.distance = t0 + (t0 - t0) * (y0 - 1) / (y0 - y1);
-		if (result.distance <= 0)
-			return false;
-
-		result.point = ray.calculatePoint(result.distance);
-		result.normal = vec4{ 0, 1, 0, 0 };
-		return true;
+		distance = t0 + (t0 - t0) * (y0 - 1) / (y0 - y1);
+		return !(distance <= 0);
 	}
 
 	return false;
 }
 
+void Cylinder::calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const
+{
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
+
+	// Which part was hit is found again from the height of the hit, the same way intersect chose it
+	const auto y = (result.point - bottomCenter).y;
+	if (y < 0)
+		result.normal = vec4{ 0, -1, 0, 0 };
+	else if (y > height)
+		result.normal = vec4{ 0, 1, 0, 0 };
+	else result.normal = normalise((result.point - bottomCenter) * xzMask);
+}
+
 Ray Cylinder::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
 {
 	throw std::exception();
 }
 
+bool Cylinder::getBounds(BoundingBox&) const
+{
+	// Distances are measured along the ray direction projected onto xz, so hits are not limited to the cylinder extent
+	return false;
+}
+
 vec4 Cylinder::getTextureCoordinates(const vec4& hitPoint) const
 {
 	throw std::exception();
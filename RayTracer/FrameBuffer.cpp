@@ -0,0 +1,215 @@
+#include "FrameBuffer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static size_t pageSize()
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// Tiled storage is padded out to whole tiles along the right and bottom edges
+static size_t storedPixels(int width, int height, FrameBufferLayout layout)
+{
+	if (layout == FrameBufferLayout::Linear)
+		return static_cast<size_t>(width) * height;
+
+	const auto paddedWidth = (width + FrameBuffer::TILE_SIZE - 1) & ~(FrameBuffer::TILE_SIZE - 1);
+	const auto paddedHeight = (height + FrameBuffer::TILE_SIZE - 1) & ~(FrameBuffer::TILE_SIZE - 1);
+	return static_cast<size_t>(paddedWidth) * paddedHeight;
+}
+
+FrameBuffer::FrameBuffer(int width, int height, FrameBufferLayout layout) :
+	width{ width },
+	height{ height },
+	tilesAcross{ (width + TILE_SIZE - 1) >> TILE_SHIFT },
+	layout{ layout },
+	pixelCount{ storedPixels(width, height, layout) }
+{
+	memory = std::unique_ptr<vec4[]>{ new vec4[pixelCount] };
+	pixels = memory.get();
+}
+
+FrameBuffer::FrameBuffer(int width, int height, FrameBufferLayout layout, const std::string& fileName) :
+	width{ width },
+	height{ height },
+	tilesAcross{ (width + TILE_SIZE - 1) >> TILE_SHIFT },
+	layout{ layout },
+	pixelCount{ storedPixels(width, height, layout) },
+	fileName{ fileName }
+{
+	const auto bytes = pixelCount * sizeof(vec4);
+
+	// A new file reads back as zeros, so the mapping starts out cleared
+#if defined(_WIN32)
+	file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = nullptr;
+		throw std::exception();
+	}
+
+	fileMapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(bytes) >> 32), static_cast<DWORD>(bytes), nullptr);
+	if (fileMapping != nullptr)
+		mapping = MapViewOfFile(fileMapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+#else
+	file = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (file < 0)
+		throw std::exception();
+
+	if (ftruncate(file, static_cast<off_t>(bytes)) == 0)
+	{
+		mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (mapping == MAP_FAILED)
+			mapping = nullptr;
+	}
+#endif
+
+	if (mapping == nullptr)
+	{
+		unmap();
+		throw std::exception();
+	}
+
+	pixels = static_cast<vec4*>(mapping);
+}
+
+FrameBuffer::~FrameBuffer()
+{
+	unmap();
+}
+
+void FrameBuffer::unmap()
+{
+#if defined(_WIN32)
+	if (mapping != nullptr)
+		UnmapViewOfFile(mapping);
+	if (fileMapping != nullptr)
+		CloseHandle(fileMapping);
+	if (file != nullptr)
+		CloseHandle(file);
+	fileMapping = nullptr;
+	file = nullptr;
+#else
+	if (mapping != nullptr)
+		munmap(mapping, pixelCount * sizeof(vec4));
+	if (file >= 0)
+		close(file);
+	file = -1;
+#endif
+
+	mapping = nullptr;
+	if (!fileName.empty())
+		remove(fileName.c_str());
+}
+
+void FrameBuffer::clear()
+{
+	if (!isMapped())
+	{
+		std::fill(pixels, pixels + pixelCount, vec4{});
+		return;
+	}
+
+#if defined(_WIN32)
+	// Cleared in bands that are evicted as they go, so the whole image is never resident
+	const auto bandRows = (std::max(1, (1 << 20) / width) + TILE_SIZE - 1) & ~(TILE_SIZE - 1);
+	for (auto y = 0; y < height; y += bandRows)
+	{
+		const auto rows = std::min(bandRows, height - y);
+		const auto first = index(0, y);
+		const auto last = y + rows >= height ? pixelCount : index(0, y + rows);
+		std::fill(pixels + first, pixels + last, vec4{});
+		evict(0, y, width, rows);
+	}
+#else
+	// Cutting the file back to nothing drops every page, growing it again reads back as zeros
+	const auto bytes = static_cast<off_t>(pixelCount * sizeof(vec4));
+	if (ftruncate(file, 0) != 0 || ftruncate(file, bytes) != 0)
+		throw std::exception();
+#endif
+}
+
+void FrameBuffer::read(int x, int y, int width, int height, float* rgba, int rowLength) const
+{
+	for (auto row = 0; row < height; row++)
+	{
+		auto destination = rgba + static_cast<size_t>(row) * rowLength * 4;
+
+		// Pixels are contiguous along a row to the end of a tile, or of the image when linear
+		for (auto column = x; column < x + width;)
+		{
+			const auto span = layout == FrameBufferLayout::Tiled ? std::min(TILE_SIZE - (column & (TILE_SIZE - 1)), x + width - column) : x + width - column;
+			memcpy(destination, &pixels[index(column, y + row)], span * sizeof(vec4));
+			destination += span * 4;
+			column += span;
+		}
+	}
+}
+
+void FrameBuffer::evict(int x, int y, int width, int height) const
+{
+	if (!isMapped() || width <= 0 || height <= 0)
+		return;
+
+	static const auto page = pageSize();
+	const auto base = static_cast<char*>(mapping);
+	const auto bytes = pixelCount * sizeof(vec4);
+
+	// Pages are rounded outwards, a page shared with a tile still being written is just paged back in
+	auto evictRange = [base, bytes](size_t first, size_t last)
+	{
+		first = first * sizeof(vec4) / page * page;
+		last = std::min((last * sizeof(vec4) + page - 1) / page * page, bytes);
+		if (last <= first)
+			return;
+
+#if defined(_WIN32)
+		FlushViewOfFile(base + first, last - first);
+		// Unlocking pages that are not locked takes them out of the working set
+		VirtualUnlock(base + first, last - first);
+#else
+		msync(base + first, last - first, MS_ASYNC);
+		madvise(base + first, last - first, MADV_DONTNEED);
+#endif
+	};
+
+	if (layout == FrameBufferLayout::Linear)
+	{
+		// Full rows are one range, otherwise each row is its own
+		if (x == 0 && width == this->width)
+			evictRange(index(0, y), index(0, y + height - 1) + width);
+		else
+		{
+			for (auto row = y; row < y + height; row++)
+				evictRange(index(x, row), index(x, row) + width);
+		}
+		return;
+	}
+
+	// A row of tiles is contiguous, from the first tile the rectangle touches to the end of the last
+	const auto tileCount = ((x + width - 1) >> TILE_SHIFT) - (x >> TILE_SHIFT) + 1;
+	for (auto tileY = y >> TILE_SHIFT; tileY <= (y + height - 1) >> TILE_SHIFT; tileY++)
+	{
+		const auto first = index(x & ~(TILE_SIZE - 1), tileY << TILE_SHIFT);
+		evictRange(first, first + static_cast<size_t>(tileCount) * TILE_SIZE * TILE_SIZE);
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "vec4.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+enum class FrameBufferLayout
+{
+	// One row after another
+	Linear,
+	// Squares of TILE_SIZE x TILE_SIZE pixels stored together, so a worker's tile shares no cache lines with another's
+	Tiled,
+};
+
+// Aligned RGBA float pixels, each written with a single vec4 store
+class FrameBuffer
+{
+public:
+	static constexpr int TILE_SHIFT = 3;
+	static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+
+	FrameBuffer(int width, int height, FrameBufferLayout layout);
+	// Keeps the pixels in a memory mapped scratch file instead of RAM, for images larger than memory.
+	// The file is created, or replaced, and deleted again with the frame buffer
+	FrameBuffer(int width, int height, FrameBufferLayout layout, const std::string& fileName);
+	~FrameBuffer();
+
+	FrameBuffer(const FrameBuffer&) = delete;
+	FrameBuffer& operator=(const FrameBuffer&) = delete;
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	FrameBufferLayout getLayout() const { return layout; }
+	bool isMapped() const { return mapping != nullptr; }
+
+	void clear();
+
+	vec4 get(int x, int y) const { return pixels[index(x, y)]; }
+	void set(int x, int y, const vec4& colour) { pixels[index(x, y)] = colour; }
+
+	// Copies a rectangle out as linear RGBA floats, with rows rowLength pixels apart
+	void read(int x, int y, int width, int height, float* rgba, int rowLength) const;
+
+	// Starts writing a finished rectangle back to the file and drops its pages from memory, does nothing when not mapped.
+	// Pixels stay readable, they are paged back in from the file
+	void evict(int x, int y, int width, int height) const;
+
+private:
+	int width;
+	int height;
+	int tilesAcross;
+	FrameBufferLayout layout;
+	size_t pixelCount;
+	vec4* pixels{};
+
+	std::unique_ptr<vec4[]> memory{};
+	void* mapping{};
+	std::string fileName{};
+#if defined(_WIN32)
+	void* file{};
+	void* fileMapping{};
+#else
+	int file{ -1 };
+#endif
+
+	size_t index(int x, int y) const
+	{
+		if (layout == FrameBufferLayout::Linear)
+			return static_cast<size_t>(y) * width + x;
+
+		const auto tile = static_cast<size_t>(y >> TILE_SHIFT) * tilesAcross + (x >> TILE_SHIFT);
+		return (tile << (TILE_SHIFT * 2)) + ((y & (TILE_SIZE - 1)) << TILE_SHIFT) + (x & (TILE_SIZE - 1));
+	}
+
+	void unmap();
+};
@@ -1,5 +1,7 @@
 #include "Image.h"
 
+#include <cstdio>
+
 #if defined(_MSC_VER)
 #include <SOIL.h>
 #else
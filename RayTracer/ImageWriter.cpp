@@ -0,0 +1,660 @@
+#include "ImageWriter.h"
+
+#include "MathsHelper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(RAYTRACER_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace
+{
+	// Rows converted by one worker at a time and written to the file together
+	constexpr int BAND_ROWS = 16;
+	// Compressed PNG data is written out in IDAT chunks of about this size
+	constexpr size_t PNG_CHUNK_SIZE = 1 << 18;
+
+	using ConvertRow = std::function<void(int y, uint8_t* row)>;
+	using WriteRows = std::function<bool(const uint8_t* rows, int count)>;
+
+	// Workers convert bands of rows into a ring of buffers while the calling thread writes the finished bands out in order.
+	// A memory mapped frame buffer has each band dropped from memory once converted
+	bool convertRows(const ImageWorkers& workers, const FrameBuffer& frameBuffer, size_t rowBytes, const ConvertRow& convert, const WriteRows& write)
+	{
+		const auto height = frameBuffer.getHeight();
+		const auto numberBands = (height + BAND_ROWS - 1) / BAND_ROWS;
+		// Workers past the number of bands find nothing to convert and finish straight away
+		const auto numberSlots = std::max(1, std::min(workers.count, numberBands)) * 2;
+
+		std::vector<std::vector<uint8_t>> slots(numberSlots, std::vector<uint8_t>(rowBytes * BAND_ROWS));
+		std::vector<int> readyBands(numberSlots, -1);
+		std::mutex mutex{};
+		std::condition_variable changed{};
+		std::atomic_int nextBand{ 0 };
+		auto writtenBands = 0;
+		auto failed = false;
+
+		auto work = [&]()
+		{
+			while (true)
+			{
+				const auto band = nextBand++;
+				if (band >= numberBands)
+					return;
+
+				// A slot is free once the band that used it before has been written
+				const auto slot = band % numberSlots;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					changed.wait(lock, [&] { return failed || band < writtenBands + numberSlots; });
+					if (failed)
+						return;
+				}
+
+				const auto first = band * BAND_ROWS;
+				const auto last = std::min(first + BAND_ROWS, height);
+				for (auto y = first; y < last; y++)
+					convert(y, slots[slot].data() + (y - first) * rowBytes);
+				// Starting a row early also drops the row above, which PNG filtering reads again
+				const auto evictFrom = std::max(first - 1, 0);
+				frameBuffer.evict(0, evictFrom, frameBuffer.getWidth(), last - evictFrom);
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					readyBands[slot] = band;
+				}
+				changed.notify_all();
+			}
+		};
+
+		workers.start(work);
+
+		for (auto band = 0; band < numberBands; band++)
+		{
+			const auto slot = band % numberSlots;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&] { return readyBands[slot] == band; });
+			}
+
+			const auto written = write(slots[slot].data(), std::min(BAND_ROWS, height - band * BAND_ROWS));
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				writtenBands = band + 1;
+				failed = !written;
+			}
+			changed.notify_all();
+
+			if (!written)
+				break;
+		}
+
+		workers.wait();
+
+		return !failed;
+	}
+
+	class OutputFile
+	{
+	public:
+		explicit OutputFile(const char* fileName) :
+			file{ fopen(fileName, "wb") }
+		{
+			if (file != nullptr)
+				setvbuf(file, nullptr, _IOFBF, 1 << 20);
+		}
+
+		~OutputFile()
+		{
+			if (file != nullptr)
+				fclose(file);
+		}
+
+		bool isOpen() const { return file != nullptr; }
+
+		bool write(const void* data, size_t size)
+		{
+			return fwrite(data, 1, size, file) == size;
+		}
+
+		bool write(const std::vector<uint8_t>& data)
+		{
+			return write(data.data(), data.size());
+		}
+
+		bool close()
+		{
+			const auto result = fclose(file) == 0;
+			file = nullptr;
+			return result;
+		}
+
+	private:
+		FILE* file;
+	};
+
+	void appendLittleEndian(std::vector<uint8_t>& data, uint32_t value, int bytes)
+	{
+		for (auto i = 0; i < bytes; i++)
+			data.push_back(static_cast<uint8_t>(value >> (i * 8)));
+	}
+
+	void appendBigEndian(std::vector<uint8_t>& data, uint32_t value)
+	{
+		for (auto i = 3; i >= 0; i--)
+			data.push_back(static_cast<uint8_t>(value >> (i * 8)));
+	}
+
+	void appendString(std::vector<uint8_t>& data, const char* text)
+	{
+		data.insert(data.end(), text, text + strlen(text) + 1);
+	}
+
+	void appendFloat(std::vector<uint8_t>& data, float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		appendLittleEndian(data, bits, 4);
+	}
+
+	// Clamps to [0, 1] and rounds to the nearest of maximum + 1 levels, leaving the channels in the four lanes
+	__m128i quantise(const vec4& colour, __m128 maximum)
+	{
+		const auto clamped = _mm_min_ps(_mm_max_ps(colour, _mm_setzero_ps()), _mm_set1_ps(1));
+		return _mm_cvtps_epi32(_mm_mul_ps(clamped, maximum));
+	}
+
+	// Red, green and blue of a row, one byte or two big endian bytes per sample
+	void quantiseRow(const FrameBuffer& frameBuffer, int y, int bitDepth, uint8_t* row)
+	{
+		const auto width = frameBuffer.getWidth();
+		if (bitDepth == 8)
+		{
+			const auto maximum = _mm_set1_ps(255);
+			for (auto x = 0; x < width; x++)
+			{
+				const auto levels = quantise(frameBuffer.get(x, y), maximum);
+				const auto bytes = _mm_packus_epi16(_mm_packs_epi32(levels, levels), levels);
+				const auto packed = static_cast<uint32_t>(_mm_cvtsi128_si32(bytes));
+				row[x * 3 + 0] = static_cast<uint8_t>(packed);
+				row[x * 3 + 1] = static_cast<uint8_t>(packed >> 8);
+				row[x * 3 + 2] = static_cast<uint8_t>(packed >> 16);
+			}
+			return;
+		}
+
+		const auto maximum = _mm_set1_ps(65535);
+		for (auto x = 0; x < width; x++)
+		{
+			alignas(16) int32_t levels[4];
+			_mm_store_si128(reinterpret_cast<__m128i*>(levels), quantise(frameBuffer.get(x, y), maximum));
+			for (auto channel = 0; channel < 3; channel++)
+			{
+				row[x * 6 + channel * 2 + 0] = static_cast<uint8_t>(levels[channel] >> 8);
+				row[x * 6 + channel * 2 + 1] = static_cast<uint8_t>(levels[channel]);
+			}
+		}
+	}
+
+	uint32_t pngCrc(uint32_t crc, const uint8_t* data, size_t size)
+	{
+		static const auto table = []
+		{
+			std::vector<uint32_t> values(256);
+			for (auto i = 0u; i < 256; i++)
+			{
+				auto value = i;
+				for (auto bit = 0; bit < 8; bit++)
+					value = (value & 1) ? 0xedb88320u ^ (value >> 1) : value >> 1;
+				values[i] = value;
+			}
+			return values;
+		}();
+
+		crc = ~crc;
+		for (auto i = 0u; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	bool writePngChunk(OutputFile& file, const char* type, const uint8_t* data, size_t size)
+	{
+		std::vector<uint8_t> header{};
+		appendBigEndian(header, static_cast<uint32_t>(size));
+		header.insert(header.end(), type, type + 4);
+
+		auto crc = pngCrc(0, header.data() + 4, 4);
+		crc = pngCrc(crc, data, size);
+
+		std::vector<uint8_t> footer{};
+		appendBigEndian(footer, crc);
+
+		return file.write(header) && (size == 0 || file.write(data, size)) && file.write(footer);
+	}
+
+	// Compresses the filtered rows of a PNG into IDAT chunks as they arrive.
+	// Without zlib the rows go into uncompressed deflate blocks, which every PNG reader accepts.
+	class PngDataWriter
+	{
+	public:
+		explicit PngDataWriter(OutputFile& file) :
+			file{ file }
+		{
+#if defined(RAYTRACER_ZLIB)
+			memset(&stream, 0, sizeof(stream));
+			valid = deflateInit(&stream, Z_DEFAULT_COMPRESSION) == Z_OK;
+#else
+			// zlib header for a 32K window and no preset dictionary
+			pending.push_back(0x78);
+			pending.push_back(0x01);
+#endif
+		}
+
+		~PngDataWriter()
+		{
+#if defined(RAYTRACER_ZLIB)
+			if (valid)
+				deflateEnd(&stream);
+#endif
+		}
+
+		bool write(const uint8_t* data, size_t size)
+		{
+#if defined(RAYTRACER_ZLIB)
+			return valid && compress(data, size, Z_NO_FLUSH);
+#else
+			adler = adler32(adler, data, size);
+			while (size > 0)
+			{
+				// Stored blocks hold at most 65535 bytes, the last block is an empty one written by finish
+				const auto blockSize = static_cast<uint32_t>(std::min<size_t>(size, 0xffff));
+				pending.push_back(0);
+				appendLittleEndian(pending, blockSize, 2);
+				appendLittleEndian(pending, ~blockSize & 0xffff, 2);
+				pending.insert(pending.end(), data, data + blockSize);
+				data += blockSize;
+				size -= blockSize;
+
+				if (pending.size() >= PNG_CHUNK_SIZE && !flush())
+					return false;
+			}
+			return true;
+#endif
+		}
+
+		bool finish()
+		{
+#if defined(RAYTRACER_ZLIB)
+			return valid && compress(nullptr, 0, Z_FINISH) && flush();
+#else
+			pending.push_back(1);
+			appendLittleEndian(pending, 0, 2);
+			appendLittleEndian(pending, 0xffff, 2);
+			appendBigEndian(pending, adler);
+			return flush();
+#endif
+		}
+
+	private:
+		OutputFile& file;
+		std::vector<uint8_t> pending{};
+
+		bool flush()
+		{
+			if (pending.empty())
+				return true;
+
+			const auto written = writePngChunk(file, "IDAT", pending.data(), pending.size());
+			pending.clear();
+			return written;
+		}
+
+#if defined(RAYTRACER_ZLIB)
+		z_stream stream;
+		bool valid;
+
+		bool compress(const uint8_t* data, size_t size, int flush)
+		{
+			stream.next_in = const_cast<Bytef*>(data);
+			stream.avail_in = static_cast<uInt>(size);
+
+			uint8_t buffer[1 << 16];
+			while (true)
+			{
+				stream.next_out = buffer;
+				stream.avail_out = sizeof(buffer);
+				const auto result = deflate(&stream, flush);
+				if (result == Z_STREAM_ERROR)
+					return false;
+
+				pending.insert(pending.end(), buffer, buffer + (sizeof(buffer) - stream.avail_out));
+				if (pending.size() >= PNG_CHUNK_SIZE && !this->flush())
+					return false;
+
+				if (flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_out != 0)
+					return true;
+			}
+		}
+#else
+		uint32_t adler = 1;
+
+		static uint32_t adler32(uint32_t adler, const uint8_t* data, size_t size)
+		{
+			auto a = adler & 0xffff;
+			auto b = adler >> 16;
+			while (size > 0)
+			{
+				// Sums stay inside 32 bits for this many bytes before they need reducing
+				const auto count = std::min<size_t>(size, 5552);
+				for (auto i = 0u; i < count; i++)
+				{
+					a += data[i];
+					b += a;
+				}
+				a %= 65521;
+				b %= 65521;
+				data += count;
+				size -= count;
+			}
+			return (b << 16) | a;
+		}
+#endif
+	};
+
+	int paeth(int left, int up, int upLeft)
+	{
+		const auto estimate = left + up - upLeft;
+		const auto distanceLeft = abs(estimate - left);
+		const auto distanceUp = abs(estimate - up);
+		const auto distanceUpLeft = abs(estimate - upLeft);
+		if (distanceLeft <= distanceUp && distanceLeft <= distanceUpLeft)
+			return left;
+		return distanceUp <= distanceUpLeft ? up : upLeft;
+	}
+
+	bool writeBmp(OutputFile& file, const FrameBuffer& frameBuffer, const ImageWorkers& workers)
+	{
+		const auto width = frameBuffer.getWidth();
+		const auto height = frameBuffer.getHeight();
+		const auto rowBytes = (static_cast<size_t>(width) * 3 + 3) & ~static_cast<size_t>(3);
+		// Sizes in the header are 32 bit
+		if (rowBytes * height > 0xffffffffu - 54)
+			return false;
+		const auto imageBytes = static_cast<uint32_t>(rowBytes * height);
+
+		std::vector<uint8_t> header{};
+		header.push_back('B');
+		header.push_back('M');
+		appendLittleEndian(header, 54 + imageBytes, 4);
+		appendLittleEndian(header, 0, 4);
+		appendLittleEndian(header, 54, 4);
+		appendLittleEndian(header, 40, 4);
+		appendLittleEndian(header, width, 4);
+		// A negative height stores the rows top down, in the order they are converted
+		appendLittleEndian(header, static_cast<uint32_t>(-height), 4);
+		appendLittleEndian(header, 1, 2);
+		appendLittleEndian(header, 24, 2);
+		appendLittleEndian(header, 0, 4);
+		appendLittleEndian(header, imageBytes, 4);
+		appendLittleEndian(header, 2835, 4);
+		appendLittleEndian(header, 2835, 4);
+		appendLittleEndian(header, 0, 4);
+		appendLittleEndian(header, 0, 4);
+		if (!file.write(header))
+			return false;
+
+		return convertRows(workers, frameBuffer, rowBytes, [&frameBuffer, width, rowBytes](int y, uint8_t* row)
+		{
+			quantiseRow(frameBuffer, y, 8, row);
+			for (auto x = 0; x < width; x++)
+				std::swap(row[x * 3 + 0], row[x * 3 + 2]);
+			memset(row + width * 3, 0, rowBytes - width * 3);
+		}, [&file, rowBytes](const uint8_t* rows, int count)
+		{
+			return file.write(rows, rowBytes * count);
+		});
+	}
+
+	bool writePpm(OutputFile& file, const FrameBuffer& frameBuffer, int bitDepth, const ImageWorkers& workers)
+	{
+		const auto width = frameBuffer.getWidth();
+		const auto rowBytes = static_cast<size_t>(width) * 3 * (bitDepth / 8);
+
+		char header[64];
+		const auto headerSize = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, frameBuffer.getHeight(), (1 << bitDepth) - 1);
+		if (!file.write(header, headerSize))
+			return false;
+
+		return convertRows(workers, frameBuffer, rowBytes, [&frameBuffer, bitDepth](int y, uint8_t* row)
+		{
+			quantiseRow(frameBuffer, y, bitDepth, row);
+		}, [&file, rowBytes](const uint8_t* rows, int count)
+		{
+			return file.write(rows, rowBytes * count);
+		});
+	}
+
+	bool writePng(OutputFile& file, const FrameBuffer& frameBuffer, int bitDepth, const ImageWorkers& workers)
+	{
+		const auto pixelBytes = 3 * (bitDepth / 8);
+		const auto sampleBytes = static_cast<size_t>(frameBuffer.getWidth()) * pixelBytes;
+		const auto rowBytes = sampleBytes + 1;
+
+		const uint8_t signature[] { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		if (!file.write(signature, sizeof(signature)))
+			return false;
+
+		std::vector<uint8_t> header{};
+		appendBigEndian(header, frameBuffer.getWidth());
+		appendBigEndian(header, frameBuffer.getHeight());
+		header.push_back(static_cast<uint8_t>(bitDepth));
+		header.push_back(2);
+		header.push_back(0);
+		header.push_back(0);
+		header.push_back(0);
+		if (!writePngChunk(file, "IHDR", header.data(), header.size()))
+			return false;
+
+		PngDataWriter data{ file };
+		const auto converted = convertRows(workers, frameBuffer, rowBytes, [&frameBuffer, bitDepth, pixelBytes, sampleBytes](int y, uint8_t* row)
+		{
+			// Paeth filtering needs the unfiltered row above, so each worker quantises that row again itself
+			thread_local std::vector<uint8_t> current{};
+			thread_local std::vector<uint8_t> previous{};
+			current.resize(sampleBytes);
+			previous.assign(sampleBytes, 0);
+
+			quantiseRow(frameBuffer, y, bitDepth, current.data());
+			if (y > 0)
+				quantiseRow(frameBuffer, y - 1, bitDepth, previous.data());
+
+			row[0] = 4;
+			for (auto i = 0u; i < sampleBytes; i++)
+			{
+				const auto left = i >= static_cast<size_t>(pixelBytes) ? current[i - pixelBytes] : 0;
+				const auto upLeft = i >= static_cast<size_t>(pixelBytes) ? previous[i - pixelBytes] : 0;
+				row[i + 1] = static_cast<uint8_t>(current[i] - paeth(left, previous[i], upLeft));
+			}
+		}, [&data, rowBytes](const uint8_t* rows, int count)
+		{
+			return data.write(rows, rowBytes * count);
+		});
+
+		return converted && data.finish() && writePngChunk(file, "IEND", nullptr, 0);
+	}
+
+	void appendExrAttribute(std::vector<uint8_t>& header, const char* name, const char* type, const std::vector<uint8_t>& value)
+	{
+		appendString(header, name);
+		appendString(header, type);
+		appendLittleEndian(header, static_cast<uint32_t>(value.size()), 4);
+		header.insert(header.end(), value.begin(), value.end());
+	}
+
+	// Uncompressed scanline OpenEXR, one row per block
+	bool writeExr(OutputFile& file, const FrameBuffer& frameBuffer, int bitDepth, const ImageWorkers& workers)
+	{
+		const auto width = frameBuffer.getWidth();
+		const auto height = frameBuffer.getHeight();
+		const auto sampleBytes = bitDepth / 8;
+		const auto dataBytes = static_cast<size_t>(width) * 3 * sampleBytes;
+		const auto rowBytes = dataBytes + 8;
+
+		std::vector<uint8_t> header{ 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+
+		// Channels are listed, and stored in each row, in alphabetical order
+		std::vector<uint8_t> channels{};
+		for (auto name : { "B", "G", "R" })
+		{
+			appendString(channels, name);
+			appendLittleEndian(channels, bitDepth == 16 ? 1 : 2, 4);
+			appendLittleEndian(channels, 0, 4);
+			appendLittleEndian(channels, 1, 4);
+			appendLittleEndian(channels, 1, 4);
+		}
+		channels.push_back(0);
+		appendExrAttribute(header, "channels", "chlist", channels);
+
+		appendExrAttribute(header, "compression", "compression", { 0 });
+
+		std::vector<uint8_t> window{};
+		appendLittleEndian(window, 0, 4);
+		appendLittleEndian(window, 0, 4);
+		appendLittleEndian(window, width - 1, 4);
+		appendLittleEndian(window, height - 1, 4);
+		appendExrAttribute(header, "dataWindow", "box2i", window);
+		appendExrAttribute(header, "displayWindow", "box2i", window);
+
+		appendExrAttribute(header, "lineOrder", "lineOrder", { 0 });
+
+		std::vector<uint8_t> one{};
+		appendFloat(one, 1);
+		appendExrAttribute(header, "pixelAspectRatio", "float", one);
+
+		std::vector<uint8_t> centre{};
+		appendFloat(centre, 0);
+		appendFloat(centre, 0);
+		appendExrAttribute(header, "screenWindowCenter", "v2f", centre);
+		appendExrAttribute(header, "screenWindowWidth", "float", one);
+		header.push_back(0);
+
+		// Every row has the same size, so the table of row offsets is known before any row is converted
+		const auto firstRow = static_cast<uint64_t>(header.size()) + static_cast<uint64_t>(height) * 8;
+		for (auto y = 0; y < height; y++)
+		{
+			const auto offset = firstRow + y * static_cast<uint64_t>(rowBytes);
+			appendLittleEndian(header, static_cast<uint32_t>(offset), 4);
+			appendLittleEndian(header, static_cast<uint32_t>(offset >> 32), 4);
+		}
+
+		if (!file.write(header))
+			return false;
+
+		return convertRows(workers, frameBuffer, rowBytes, [&frameBuffer, width, sampleBytes, dataBytes](int y, uint8_t* row)
+		{
+			const auto rowSize = static_cast<uint32_t>(dataBytes);
+			memcpy(row, &y, 4);
+			memcpy(row + 4, &rowSize, 4);
+
+			const auto data = row + 8;
+			for (auto x = 0; x < width; x++)
+			{
+				const auto colour = frameBuffer.get(x, y);
+				const float values[] { colour.z, colour.y, colour.x };
+				for (auto channel = 0; channel < 3; channel++)
+				{
+					const auto destination = data + (static_cast<size_t>(channel) * width + x) * sampleBytes;
+					if (sampleBytes == 2)
+					{
+						const auto half = toHalf(values[channel]);
+						memcpy(destination, &half, 2);
+					}
+					else memcpy(destination, &values[channel], 4);
+				}
+			}
+		}, [&file, rowBytes](const uint8_t* rows, int count)
+		{
+			return file.write(rows, rowBytes * count);
+		});
+	}
+}
+
+bool imageFormatFromFileName(const char* fileName, ImageFormat& format)
+{
+	const auto extension = strrchr(fileName, '.');
+	if (extension == nullptr)
+		return false;
+
+	std::string lowerExtension{ extension };
+	for (auto& c : lowerExtension)
+		c = static_cast<char>(tolower(c));
+
+	if (lowerExtension == ".bmp")
+		format = ImageFormat::Bmp;
+	else if (lowerExtension == ".ppm")
+		format = ImageFormat::Ppm;
+	else if (lowerExtension == ".png")
+		format = ImageFormat::Png;
+	else if (lowerExtension == ".exr")
+		format = ImageFormat::Exr;
+	else return false;
+
+	return true;
+}
+
+bool isBitDepthSupported(ImageFormat format, int bitDepth)
+{
+	switch (format)
+	{
+	case ImageFormat::Bmp:
+		return bitDepth == 8;
+	case ImageFormat::Ppm:
+	case ImageFormat::Png:
+		return bitDepth == 8 || bitDepth == 16;
+	case ImageFormat::Exr:
+		return bitDepth == 16 || bitDepth == 32;
+	}
+
+	return false;
+}
+
+bool writeImage(const FrameBuffer& frameBuffer, const char* fileName, ImageFormat format, int bitDepth, const ImageWorkers& workers)
+{
+	if (!isBitDepthSupported(format, bitDepth))
+		return false;
+
+	OutputFile file{ fileName };
+	if (!file.isOpen())
+		return false;
+
+	auto written = false;
+	switch (format)
+	{
+	case ImageFormat::Bmp:
+		written = writeBmp(file, frameBuffer, workers);
+		break;
+	case ImageFormat::Ppm:
+		written = writePpm(file, frameBuffer, bitDepth, workers);
+		break;
+	case ImageFormat::Png:
+		written = writePng(file, frameBuffer, bitDepth, workers);
+		break;
+	case ImageFormat::Exr:
+		written = writeExr(file, frameBuffer, bitDepth, workers);
+		break;
+	}
+
+	return file.close() && written;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "FrameBuffer.h"
+
+#include <functional>
+
+enum class ImageFormat
+{
+	Bmp,
+	Ppm,
+	Png,
+	Exr,
+};
+
+// Picks the format from the file extension, returns false if it is not one of bmp, ppm, png or exr
+bool imageFormatFromFileName(const char* fileName, ImageFormat& format);
+
+// Whether a format can store samples of bitDepth bits: 8 for BMP, 8 or 16 for PPM and PNG, 16 (half) or 32 (float) for EXR
+bool isBitDepthSupported(ImageFormat format, int bitDepth);
+
+// Threads that convert rows while the calling thread writes them out, such as the idle workers of a RayTracer.
+// start runs work once on each of the count threads and returns straight away, wait returns once they have all finished
+struct ImageWorkers
+{
+	int count;
+	std::function<void(std::function<void()> work)> start;
+	std::function<void()> wait;
+};
+
+// Converts rows on the workers and streams them to the file as they are ready.
+// Integer formats are clamped and rounded, EXR keeps the values as they are. Returns false if the file could not be written.
+bool writeImage(const FrameBuffer& frameBuffer, const char* fileName, ImageFormat format, int bitDepth, const ImageWorkers& workers);
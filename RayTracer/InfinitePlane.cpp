@@ -3,16 +3,24 @@
 #include <limits>
 #include "MathsHelper.h"
 
-bool InfinitePlane::intersect(const Ray& ray, IntersectionResult& result) const
+bool InfinitePlane::intersect(const Ray& ray, float& distance, int&) const
 {
-	result.distance = dot(this->position - ray.position, normal) / dot(ray.direction, normal);
+	distance = dot(this->position - ray.position, normal) / dot(ray.direction, normal);
 
-	if (fabs(result.distance) < std::numeric_limits<float>::epsilon() || result.distance < 0)
-		return false;
+	return !(fabs(distance) < std::numeric_limits<float>::epsilon() || distance < 0);
+}
 
-	result.point = ray.calculatePoint(result.distance);
+void InfinitePlane::calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const
+{
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
 	result.normal = normal;
-	return true;
+}
+
+__m128 InfinitePlane::intersectPacket(const RayPacket& packet) const
+{
+	const auto distance = packet.planeDistance(position, normal);
+	return select(_mm_cmpge_ps(distance, _mm_setzero_ps()), distance, _mm_set1_ps(std::numeric_limits<float>::infinity()));
 }
 
 Ray InfinitePlane::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
@@ -20,6 +28,11 @@ Ray InfinitePlane::handleRefraction(const vec4& direction, const vec4& hitPoint,
 	throw std::exception();
 }
 
+bool InfinitePlane::getBounds(BoundingBox&) const
+{
+	return false;
+}
+
 vec4 InfinitePlane::getTextureCoordinates(const vec4& hitPoint) const
 {
 	return hitPoint;
@@ -1,10 +1,12 @@
 #include "JsonSceneLoader.h"
 
+#include "Box.h"
 #include "Camera.h"
 #include "Cone.h"
 #include "Cylinder.h"
 #include "InfinitePlane.h"
 #include "Material.h"
+#include "MeshLoader.h"
 #include "Polygon.h"
 #include "RayTracer.h"
 #include "SolidMaterial.h"
@@ -13,6 +15,7 @@
 #include "StripedMaterial.h"
 #include "TexturedMaterial.h"
 #include "Torus.h"
+#include "TriangleMesh.h"
 
 #include <rapidjson/document.h>
 #include <cstring>
@@ -297,14 +300,47 @@ namespace
 		rayTracer->add(std::make_unique<Torus>(position, majorRadius, minorRadius, move(material)));
 	}
 
+	void parseMesh(RayTracer* rayTracer, const rapidjson::Value& object)
+	{
+		auto mesh = loadMesh(object["path"].GetString());
+		auto material = parseMaterial(rayTracer, object["material"]);
+
+		auto position = vec4{};
+		if (object.HasMember("position"))
+			position = parseVector(object["position"]);
+
+		float scale = 1;
+		if (object.HasMember("scale"))
+			scale = static_cast<float>(object["scale"].GetDouble());
+
+		for (auto i = 0u; i < mesh.x.size(); i++)
+		{
+			mesh.x[i] = mesh.x[i] * scale + position.x;
+			mesh.y[i] = mesh.y[i] * scale + position.y;
+			mesh.z[i] = mesh.z[i] * scale + position.z;
+		}
+
+		rayTracer->add(std::make_unique<TriangleMesh>(std::move(mesh), move(material)));
+	}
+
 	void parseCube(RayTracer* rayTracer, const rapidjson::Value& object)
 	{
 		auto position = parseVector(object["position"]);
+		// One length for a cube, or one per axis
+		const auto& sizeValue = object["size"];
+		vec4 size;
+		if (sizeValue.IsNumber())
+		{
+			const auto length = static_cast<float>(sizeValue.GetDouble());
+			size = vec4{ length, length, length, 0 };
+		}
+		else size = parseVector(sizeValue);
+		// A flat or inside out box has no faces to hit or take normals from
+		if (!(size.x > 0 && size.y > 0 && size.z > 0))
+			throw std::exception();
 		auto material = parseMaterial(rayTracer, object["material"]);
 
-		throw std::exception();
-
-		//rayTracer->add(std::make_unique<Torus>(position, majorRadius, minorRadius, move(material)));
+		rayTracer->add(std::make_unique<Box>(position, size, move(material)));
 	}
 
 	void parseObject(RayTracer* rayTracer, const rapidjson::Value& object)
@@ -323,6 +359,8 @@ namespace
 			parseCone(rayTracer, object);
 		else if (strcmp(type, "torus") == 0)
 			parseTorus(rayTracer, object);
+		else if (strcmp(type, "mesh") == 0)
+			parseMesh(rayTracer, object);
 		else if (strcmp(type, "cube") == 0)
 			parseCube(rayTracer, object);
 		else
@@ -1,5 +1,7 @@
 #pragma once
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
 
 constexpr float PI = 3.14159265358979323846f;
 constexpr float TWO_PI = 2 * PI;
@@ -8,4 +10,67 @@ constexpr float HALF_PI = PI / 2;
 static float saturate(float value)
 {
 	return std::min(std::max(value, 0.0f), 1.0f);
-}
\ No newline at end of file
+}
+
+// Rounds to the nearest half, ties to even, keeping infinities and NaNs
+inline uint16_t toHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	const auto sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+	const auto floatExponent = static_cast<int>((bits >> 23) & 0xff);
+	auto mantissa = bits & 0x7fffff;
+
+	if (floatExponent == 0xff)
+		return static_cast<uint16_t>(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+
+	const auto exponent = floatExponent - 127 + 15;
+	if (exponent >= 31)
+		return static_cast<uint16_t>(sign | 0x7c00);
+
+	auto shift = 13;
+	auto half = 0u;
+	if (exponent <= 0)
+	{
+		// Below the smallest normal half the value becomes a subnormal, with the implicit bit shifted into the mantissa
+		if (exponent < -10)
+			return sign;
+
+		mantissa |= 0x800000;
+		shift = 14 - exponent;
+	}
+	else half = static_cast<uint32_t>(exponent) << 10;
+
+	half |= mantissa >> shift;
+	const auto remainder = mantissa & ((1u << shift) - 1);
+	const auto halfway = 1u << (shift - 1);
+	// A carry out of the mantissa moves correctly into the exponent, up to infinity
+	if (remainder > halfway || (remainder == halfway && (half & 1)))
+		half++;
+
+	return static_cast<uint16_t>(sign | half);
+}
+
+inline float fromHalf(uint16_t half)
+{
+	const auto sign = static_cast<uint32_t>(half & 0x8000) << 16;
+	const auto exponent = static_cast<uint32_t>(half >> 10) & 0x1f;
+	const auto mantissa = static_cast<uint32_t>(half) & 0x3ff;
+
+	// Subnormal halves are normal floats, so they are scaled instead of rebuilt bit by bit
+	if (exponent == 0)
+	{
+		const auto value = mantissa * 5.9604644775390625e-8f;
+		return sign != 0 ? -value : value;
+	}
+
+	auto bits = sign | (mantissa << 13);
+	if (exponent == 0x1f)
+		bits |= 0x7f800000;
+	else bits |= (exponent + 127 - 15) << 23;
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
@@ -0,0 +1,429 @@
+#include "MeshLoader.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+
+namespace
+{
+	std::string readFile(const char* fileName)
+	{
+		std::ifstream file{ fileName, std::ios::binary };
+
+		if (!file)
+			throw std::exception();
+
+		std::string text;
+
+		file.seekg(0, std::ios::end);
+		text.resize(static_cast<size_t>(file.tellg()));
+		file.seekg(0, std::ios::beg);
+		file.read(&text[0], text.size());
+
+		return text;
+	}
+
+	void addFan(MeshData& mesh, const std::vector<int>& face)
+	{
+		if (face.size() < 3)
+			throw std::exception();
+
+		for (auto i = 1u; i + 1 < face.size(); i++)
+		{
+			mesh.indices.push_back(face[0]);
+			mesh.indices.push_back(face[i]);
+			mesh.indices.push_back(face[i + 1]);
+		}
+	}
+
+	enum class PlyFormat
+	{
+		Ascii,
+		BinaryLittleEndian,
+		BinaryBigEndian,
+	};
+
+	enum class PlyType
+	{
+		Int8,
+		UInt8,
+		Int16,
+		UInt16,
+		Int32,
+		UInt32,
+		Float32,
+		Float64,
+	};
+
+	struct PlyProperty
+	{
+		std::string name;
+		PlyType type;
+		bool isList;
+		PlyType countType;
+	};
+
+	struct PlyElement
+	{
+		std::string name;
+		int count;
+		std::vector<PlyProperty> properties;
+	};
+
+	PlyType parsePlyType(const std::string& name)
+	{
+		if (name == "char" || name == "int8")
+			return PlyType::Int8;
+		if (name == "uchar" || name == "uint8")
+			return PlyType::UInt8;
+		if (name == "short" || name == "int16")
+			return PlyType::Int16;
+		if (name == "ushort" || name == "uint16")
+			return PlyType::UInt16;
+		if (name == "int" || name == "int32")
+			return PlyType::Int32;
+		if (name == "uint" || name == "uint32")
+			return PlyType::UInt32;
+		if (name == "float" || name == "float32")
+			return PlyType::Float32;
+		if (name == "double" || name == "float64")
+			return PlyType::Float64;
+
+		throw std::exception();
+	}
+
+	int plyTypeSize(PlyType type)
+	{
+		switch (type)
+		{
+		case PlyType::Int8:
+		case PlyType::UInt8:
+			return 1;
+		case PlyType::Int16:
+		case PlyType::UInt16:
+			return 2;
+		case PlyType::Int32:
+		case PlyType::UInt32:
+		case PlyType::Float32:
+			return 4;
+		case PlyType::Float64:
+			return 8;
+		}
+
+		throw std::exception();
+	}
+
+	class PlyReader
+	{
+	public:
+		PlyReader(const char* current, const char* end, PlyFormat format) :
+			current{ current },
+			end{ end },
+			format{ format }
+		{
+		}
+
+		double read(PlyType type)
+		{
+			if (format == PlyFormat::Ascii)
+			{
+				char* next;
+				const auto value = strtod(current, &next);
+				if (next == current || next > end)
+					throw std::exception();
+
+				current = next;
+				return value;
+			}
+
+			const auto size = plyTypeSize(type);
+			if (end - current < size)
+				throw std::exception();
+
+			// The host is assumed to be little endian, as the rest of the tracer needs SSE anyway
+			uint8_t bytes[8];
+			memcpy(bytes, current, size);
+			if (format == PlyFormat::BinaryBigEndian)
+			{
+				for (auto i = 0; i < size / 2; i++)
+					std::swap(bytes[i], bytes[size - 1 - i]);
+			}
+			current += size;
+
+			switch (type)
+			{
+			case PlyType::Int8:
+				return static_cast<int8_t>(bytes[0]);
+			case PlyType::UInt8:
+				return bytes[0];
+			case PlyType::Int16:
+			{
+				int16_t value;
+				memcpy(&value, bytes, sizeof(value));
+				return value;
+			}
+			case PlyType::UInt16:
+			{
+				uint16_t value;
+				memcpy(&value, bytes, sizeof(value));
+				return value;
+			}
+			case PlyType::Int32:
+			{
+				int32_t value;
+				memcpy(&value, bytes, sizeof(value));
+				return value;
+			}
+			case PlyType::UInt32:
+			{
+				uint32_t value;
+				memcpy(&value, bytes, sizeof(value));
+				return value;
+			}
+			case PlyType::Float32:
+			{
+				float value;
+				memcpy(&value, bytes, sizeof(value));
+				return value;
+			}
+			case PlyType::Float64:
+			{
+				double value;
+				memcpy(&value, bytes, sizeof(value));
+				return value;
+			}
+			}
+
+			throw std::exception();
+		}
+
+	private:
+		const char* current;
+		const char* end;
+		PlyFormat format;
+	};
+}
+
+MeshData loadMesh(const char* fileName)
+{
+	const auto extension = strrchr(fileName, '.');
+	if (extension == nullptr)
+		throw std::exception();
+
+	std::string lowerExtension{ extension };
+	for (auto& c : lowerExtension)
+		c = static_cast<char>(tolower(c));
+
+	if (lowerExtension == ".obj")
+		return loadObj(fileName);
+	if (lowerExtension == ".ply")
+		return loadPly(fileName);
+
+	throw std::exception();
+}
+
+MeshData loadObj(const char* fileName)
+{
+	const auto text = readFile(fileName);
+
+	MeshData mesh{};
+	std::vector<int> face{};
+
+	auto current = text.c_str();
+	const auto end = current + text.size();
+	while (current < end)
+	{
+		auto lineEnd = static_cast<const char*>(memchr(current, '\n', end - current));
+		if (lineEnd == nullptr)
+			lineEnd = end;
+
+		while (current < lineEnd && (*current == ' ' || *current == '\t'))
+			current++;
+
+		if (lineEnd - current > 1 && current[0] == 'v' && isspace(current[1]))
+		{
+			current++;
+
+			float position[3];
+			for (auto& value : position)
+			{
+				char* next;
+				value = strtof(current, &next);
+				if (next == current || next > lineEnd)
+					throw std::exception();
+				current = next;
+			}
+
+			mesh.x.push_back(position[0]);
+			mesh.y.push_back(position[1]);
+			mesh.z.push_back(position[2]);
+		}
+		else if (lineEnd - current > 1 && current[0] == 'f' && isspace(current[1]))
+		{
+			current++;
+
+			// Only the position index of each vertex is used, texture coordinate and normal indices are skipped
+			face.clear();
+			while (true)
+			{
+				while (current < lineEnd && isspace(*current))
+					current++;
+				if (current >= lineEnd)
+					break;
+
+				char* next;
+				const auto index = strtol(current, &next, 10);
+				if (next == current)
+					throw std::exception();
+
+				// Negative indices count back from the last vertex read
+				const auto vertexCount = static_cast<long>(mesh.x.size());
+				if (index > 0)
+					face.push_back(static_cast<int>(index - 1));
+				else if (index < 0)
+					face.push_back(static_cast<int>(vertexCount + index));
+				else throw std::exception();
+
+				current = next;
+				while (current < lineEnd && !isspace(*current))
+					current++;
+			}
+
+			addFan(mesh, face);
+		}
+
+		current = lineEnd + 1;
+	}
+
+	return mesh;
+}
+
+MeshData loadPly(const char* fileName)
+{
+	const auto text = readFile(fileName);
+
+	const auto headerEnd = text.find("end_header");
+	if (text.compare(0, 3, "ply") != 0 || headerEnd == std::string::npos)
+		throw std::exception();
+
+	auto dataStart = text.find('\n', headerEnd);
+	if (dataStart == std::string::npos)
+		throw std::exception();
+	dataStart++;
+
+	std::istringstream header{ text.substr(0, headerEnd) };
+	std::vector<PlyElement> elements{};
+	auto format = PlyFormat::Ascii;
+
+	std::string line;
+	while (std::getline(header, line))
+	{
+		std::istringstream words{ line };
+		std::string keyword;
+		words >> keyword;
+
+		if (keyword == "format")
+		{
+			std::string name;
+			words >> name;
+			if (name == "ascii")
+				format = PlyFormat::Ascii;
+			else if (name == "binary_little_endian")
+				format = PlyFormat::BinaryLittleEndian;
+			else if (name == "binary_big_endian")
+				format = PlyFormat::BinaryBigEndian;
+			else throw std::exception();
+		}
+		else if (keyword == "element")
+		{
+			PlyElement element{};
+			words >> element.name >> element.count;
+			if (!words)
+				throw std::exception();
+			elements.push_back(element);
+		}
+		else if (keyword == "property")
+		{
+			if (elements.empty())
+				throw std::exception();
+
+			PlyProperty property{};
+			std::string type;
+			words >> type;
+			if (type == "list")
+			{
+				std::string countType;
+				words >> countType >> type;
+				property.isList = true;
+				property.countType = parsePlyType(countType);
+			}
+			property.type = parsePlyType(type);
+			words >> property.name;
+			if (!words)
+				throw std::exception();
+
+			elements.back().properties.push_back(property);
+		}
+	}
+
+	MeshData mesh{};
+	std::vector<int> face{};
+
+	PlyReader reader{ text.c_str() + dataStart, text.c_str() + text.size(), format };
+	for (const auto& element : elements)
+	{
+		const auto isVertex = element.name == "vertex";
+		const auto isFace = element.name == "face";
+
+		if (isVertex)
+		{
+			mesh.x.reserve(element.count);
+			mesh.y.reserve(element.count);
+			mesh.z.reserve(element.count);
+		}
+
+		for (auto i = 0; i < element.count; i++)
+		{
+			float position[3]{};
+			for (const auto& property : element.properties)
+			{
+				if (property.isList)
+				{
+					const auto count = static_cast<int>(reader.read(property.countType));
+					const auto isIndices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+
+					face.clear();
+					for (auto j = 0; j < count; j++)
+					{
+						const auto value = reader.read(property.type);
+						if (isIndices)
+							face.push_back(static_cast<int>(value));
+					}
+
+					if (isIndices)
+						addFan(mesh, face);
+					continue;
+				}
+
+				const auto value = static_cast<float>(reader.read(property.type));
+				if (isVertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z')
+					position[property.name[0] - 'x'] = value;
+			}
+
+			if (isVertex)
+			{
+				mesh.x.push_back(position[0]);
+				mesh.y.push_back(position[1]);
+				mesh.z.push_back(position[2]);
+			}
+		}
+	}
+
+	return mesh;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <vector>
+
+// Indexed triangles, with vertex positions stored as one array per axis
+struct MeshData
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	// Three vertex indices per triangle
+	std::vector<int> indices;
+};
+
+// Loads an OBJ or PLY file depending on its extension, polygons are split into triangle fans
+MeshData loadMesh(const char* fileName);
+MeshData loadObj(const char* fileName);
+MeshData loadPly(const char* fileName);
@@ -1,5 +1,7 @@
 #include "Polygon.h"
 
+#include <limits>
+
 float planeIntersection(const vec4& planePosition, const vec4& planeNormal, const Ray& ray)
 {
 	const auto d = dot(planePosition - ray.position, planeNormal) / dot(ray.direction, planeNormal);
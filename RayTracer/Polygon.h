@@ -24,21 +24,68 @@ public:
 		normal = calculateNormal(points[0], points[1], points[2]);
 	}
 
-	bool intersect(const Ray& ray, IntersectionResult& result) const override
+	bool intersect(const Ray& ray, float& distance, int&) const override
 	{
-		result.distance = planeIntersection(points[0], normal, ray);
-		if (result.distance < 0)
+		distance = planeIntersection(points[0], normal, ray);
+		if (distance < 0)
 			return false;
 
-		result.point = ray.calculatePoint(result.distance);
+		return inside(ray.calculatePoint(distance));
+	}
+
+	void calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const override
+	{
+		result.distance = distance;
+		result.point = ray.calculatePoint(distance);
 		result.normal = normal;
-		return inside(result.point);
+	}
+
+	__m128 intersectPacket(const RayPacket& packet) const override
+	{
+		const auto distance = packet.planeDistance(points[0], normal);
+		const auto pointX = _mm_add_ps(packet.position[0], _mm_mul_ps(packet.direction[0], distance));
+		const auto pointY = _mm_add_ps(packet.position[1], _mm_mul_ps(packet.direction[1], distance));
+		const auto pointZ = _mm_add_ps(packet.position[2], _mm_mul_ps(packet.direction[2], distance));
+
+		// (line x value) . normal is the same as value . (normal x line), so one dot product per edge
+		__m128 original{};
+		auto signDifference = _mm_setzero_ps();
+		for (auto i = 0; i < size; i++)
+		{
+			const auto edgeNormal = cross(normal, points[(i + 1) % size] - points[i]);
+			const auto side = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_sub_ps(pointX, _mm_set1_ps(points[i].x)), _mm_set1_ps(edgeNormal.x)),
+				_mm_mul_ps(_mm_sub_ps(pointY, _mm_set1_ps(points[i].y)), _mm_set1_ps(edgeNormal.y))),
+				_mm_mul_ps(_mm_sub_ps(pointZ, _mm_set1_ps(points[i].z)), _mm_set1_ps(edgeNormal.z)));
+
+			if (i == 0)
+				original = side;
+			else signDifference = _mm_or_ps(signDifference, _mm_xor_ps(original, side));
+		}
+
+		// Inside when every edge gives the same sign as the first
+		const auto outside = _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(signDifference), 31));
+		const auto hit = _mm_andnot_ps(outside, _mm_cmpge_ps(distance, _mm_setzero_ps()));
+		return select(hit, distance, _mm_set1_ps(std::numeric_limits<float>::infinity()));
 	}
 	Ray handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const override
 	{
 		throw std::exception();
 	}
 
+	PrimitiveType getPrimitiveType() const override
+	{
+		return size == 3 ? PrimitiveType::Triangle : size == 4 ? PrimitiveType::Quad : PrimitiveType::Unsupported;
+	}
+
+	bool getBounds(BoundingBox& bounds) const override
+	{
+		bounds = BoundingBox{};
+		for (auto i = 0; i < size; i++)
+			bounds.extend(points[i]);
+		return true;
+	}
+
 	vec4 getTextureCoordinates(const vec4& hitPoint) const override;
 
 private:
@@ -0,0 +1,79 @@
+#pragma once
+#include "AlignedObject.h"
+#include "Ray.h"
+#include "vec4.h"
+
+#include <limits>
+
+// Four rays in SoA form so they can be traversed and intersected together
+struct alignas(16) RayPacket : AlignedObject
+{
+	static constexpr int SIZE = 4;
+
+	Ray rays[SIZE];
+	__m128 position[3];
+	__m128 direction[3];
+	__m128 inverseDirection[3];
+
+	explicit RayPacket(const Ray* source)
+	{
+		alignas(16) float values[3][2][SIZE];
+		for (auto i = 0; i < SIZE; i++)
+		{
+			rays[i] = source[i];
+			for (auto axis = 0; axis < 3; axis++)
+			{
+				values[axis][0][i] = source[i].position[axis];
+				values[axis][1][i] = source[i].direction[axis];
+			}
+		}
+
+		for (auto axis = 0; axis < 3; axis++)
+		{
+			position[axis] = _mm_load_ps(values[axis][0]);
+			direction[axis] = _mm_load_ps(values[axis][1]);
+			inverseDirection[axis] = _mm_div_ps(_mm_set1_ps(1), direction[axis]);
+		}
+	}
+
+	// Distance along each ray to the plane, or a negative value where the ray is parallel to it
+	__m128 planeDistance(const vec4& planePosition, const vec4& planeNormal) const
+	{
+		const auto normalX = _mm_set1_ps(planeNormal.x);
+		const auto normalY = _mm_set1_ps(planeNormal.y);
+		const auto normalZ = _mm_set1_ps(planeNormal.z);
+
+		const auto numerator = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planePosition.x), position[0]), normalX),
+			_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planePosition.y), position[1]), normalY)),
+			_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planePosition.z), position[2]), normalZ));
+		const auto denominator = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(direction[0], normalX),
+			_mm_mul_ps(direction[1], normalY)),
+			_mm_mul_ps(direction[2], normalZ));
+
+		const auto distance = _mm_div_ps(numerator, denominator);
+		const auto absolute = _mm_andnot_ps(_mm_set1_ps(-0.0f), distance);
+		const auto parallel = _mm_cmplt_ps(absolute, _mm_set1_ps(std::numeric_limits<float>::epsilon()));
+		return _mm_or_ps(_mm_andnot_ps(parallel, distance), _mm_and_ps(parallel, _mm_set1_ps(-1)));
+	}
+
+	// Slab test against an axis aligned box. entry and exit start as the range of distances to consider
+	// and are narrowed to where each ray enters and leaves the box, a ray misses where entry > exit
+	void slabs(const vec4& minimum, const vec4& maximum, __m128& entry, __m128& exit) const
+	{
+		for (auto axis = 0; axis < 3; axis++)
+		{
+			const auto t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minimum[axis]), position[axis]), inverseDirection[axis]);
+			const auto t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maximum[axis]), position[axis]), inverseDirection[axis]);
+			entry = _mm_max_ps(entry, _mm_min_ps(t0, t1));
+			exit = _mm_min_ps(exit, _mm_max_ps(t0, t1));
+		}
+	}
+};
+
+// Selects lhs where mask is set, otherwise rhs
+inline __m128 select(const __m128& mask, const __m128& lhs, const __m128& rhs)
+{
+	return _mm_or_ps(_mm_and_ps(mask, lhs), _mm_andnot_ps(mask, rhs));
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "Ray.h"
+#include "SceneObject.h"
+#include "vec4.h"
+
+// A ray in one bounce level of the wavefront renderer
+struct StreamRay
+{
+	Ray ray;
+	ObjectPart self;
+
+	// Lit colour of the hit, the secondary ray's colour is added to it scaled by weight
+	vec4 base;
+	// Colour used for the secondary ray when it was not traced because the bounce limit was hit
+	vec4 secondary;
+	// Final colour, filled in when the levels are resolved
+	vec4 colour;
+	float weight;
+	// Index of the secondary ray in the next level, or -1 if it was not traced
+	int child;
+	bool hit;
+	bool hasSecondary;
+};
+
+// A shadow ray generated by the shading stage, tested in a batch afterwards
+struct StreamShadowRay
+{
+	Ray ray;
+	float maxDistance;
+	// Index of the StreamRay being lit
+	int parent;
+	// Diffuse and specular light reaching the hit if nothing is in the way
+	vec4 light;
+};
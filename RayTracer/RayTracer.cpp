@@ -4,106 +4,285 @@
 
 #include "Image.h"
 #include "MathsHelper.h"
+#include "Sampler.h"
 #include "SceneObject.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <limits>
 #include <memory>
-#include <future>
-
-#if defined(_MSC_VER)
-#include <SOIL.h>
-#else
-#include <SOIL/SOIL.h>
-#endif
+#include <thread>
 
 static constexpr int DEFAULT_SIZE = 512;
 
 static constexpr float WIDTH = 20.0f;
 static constexpr float HEIGHT = 20.0f;
 static constexpr float EDIST = 40.0f;
-static constexpr float XMIN = -WIDTH * 0.5f;
-static constexpr float XMAX = WIDTH * 0.5f;
 static constexpr float YMIN = -HEIGHT * 0.5f;
 static constexpr float YMAX = HEIGHT * 0.5f;
-static constexpr int THREADS = 4;
+
+static constexpr int MIN_TILE_SIZE = 8;
+static constexpr int MAX_TILE_SIZE = 64;
+// Enough tiles per worker for stealing to even out expensive regions
+static constexpr int TILES_PER_THREAD = 16;
+// Upper bound on primary and shadow rays traced for a single tile
+static constexpr int MAX_TILE_RAYS = 16384;
+
+// Objects of the BVH tested on their own, and spheres already tested with the block of an earlier sphere in their leaf
+static constexpr int NOT_IN_BLOCK = -1;
+static constexpr int IN_EARLIER_BLOCK = -2;
+// Times a pixel can be split into quarters by adaptive anti aliasing
+static constexpr int MAX_ADAPTIVE_DEPTH = 3;
+
+// Interleaves the bits of x and y, giving the Z-order position of a tile
+static uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t value)
+	{
+		value &= 0x0000FFFF;
+		value = (value | (value << 8)) & 0x00FF00FF;
+		value = (value | (value << 4)) & 0x0F0F0F0F;
+		value = (value | (value << 2)) & 0x33333333;
+		value = (value | (value << 1)) & 0x55555555;
+		return value;
+	};
+
+	return spread(x) | (spread(y) << 1);
+}
+
+static bool equal(const vec4& lhs, const vec4& rhs)
+{
+	return _mm_movemask_ps(_mm_cmpeq_ps(lhs, rhs)) == 0xf;
+}
 
 RayTracer::RayTracer()
 {
-	setSize(DEFAULT_SIZE);
+	setSize(DEFAULT_SIZE, DEFAULT_SIZE);
 	antiAliasing =
 	{
 		AntiAliasingMode::None,
 		2
 	};
 
-	/*running = true;
-	threads.resize(THREADS);
-	for (auto i = 0; i < THREADS; i++)
-		threads[i] = std::thread{ threadFunc, this };*/
+	auto threadCount = std::thread::hardware_concurrency();
+	if (threadCount == 0)
+		threadCount = 1;
+
+	queues.resize(threadCount);
+	for (auto& queue : queues)
+		queue = std::make_unique<WorkQueue>();
+
+	threads.resize(threadCount);
+	for (auto i = 0u; i < threadCount; i++)
+		threads[i] = std::thread{ threadFunc, this, static_cast<int>(i) };
 }
 
 RayTracer::~RayTracer()
 {
-	/*running = false;
-	for (auto i = 0; i < THREADS; i++)
+	cancelRayTrace();
+
 	{
-		threads[i].join();
-	}*/
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	workConditionVariable.notify_all();
+
+	for (auto& thread : threads)
+		thread.join();
 }
 
-//void RayTracer::startRayTrace()
-//{
-//	createTasks();
-//
-//	taskPtr = 0;
-//	tasksDone = 0;
-//
-//	{
-//		std::lock_guard<std::mutex> lock(mutex);
-//		workToDo = true;
-//	}
-//
-//	workConditionVariable.notify_all();
-//}
+void RayTracer::startRayTrace()
+{
+	stopProgressive();
+
+	if (sceneChanged)
+		buildAccelerator();
+
+	// Once a whole frame has filled the G-buffer, later frames with the same visibility shade from it
+	const auto cacheable = gBufferCaching && antiAliasing.mode == AntiAliasingMode::None;
+	shadingFromGBuffer = cacheable && gBufferValid && gBufferVersion == visibilityVersion;
+	fillingGBuffer = cacheable && !shadingFromGBuffer;
+	if (fillingGBuffer)
+	{
+		if (gBuffer == nullptr)
+			gBuffer = std::unique_ptr<GBufferSample[]>{ new GBufferSample[static_cast<size_t>(width) * height] };
+		gBufferVersion = visibilityVersion;
+		gBufferValid = true;
+	}
+
+	// Shadows can be cached whenever the G-buffer is used, and refilled while shading from an unchanged G-buffer
+	const auto shadowCacheable = shadowCaching && (shadingFromGBuffer || fillingGBuffer) && !lights.empty();
+	shadingFromShadowCache = shadowCacheable && shadingFromGBuffer && shadowCacheValid &&
+		shadowCacheVisibility == visibilityVersion && shadowCacheVersion == shadowVersion;
+	fillingShadowCache = shadowCacheable && !shadingFromShadowCache;
+	if (fillingShadowCache)
+	{
+		const auto size = static_cast<size_t>(width) * height * lights.size();
+		if (size != shadowCacheSize)
+		{
+			shadowCache = std::unique_ptr<uint64_t[]>{ new uint64_t[size] };
+			shadowCacheSize = size;
+		}
+		shadowCacheVisibility = visibilityVersion;
+		shadowCacheVersion = shadowVersion;
+		shadowCacheValid = true;
+	}
+
+	createTasks();
+	queueTasks();
+
+	// A crop window traces over its own pixels and keeps the rest
+	if (!isCropped())
+		frameBuffer->clear();
+
+	cancelled = false;
+	wakeWorkers(nullptr);
+}
 
 void RayTracer::rayTrace()
 {
-	createTasks();
+	startRayTrace();
+	waitRayTrace();
+}
 
-	switch (antiAliasing.mode)
+void RayTracer::waitRayTrace()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	doneConditionVariable.wait(lock, [this] { return busyThreads == 0; });
+}
+
+void RayTracer::cancelRayTrace()
+{
+	// A frame stopped part way leaves holes in the G-buffer it was filling
+	if (busyThreads != 0 && fillingGBuffer)
+		gBufferValid = false;
+	if (busyThreads != 0 && fillingShadowCache)
+		shadowCacheValid = false;
+
+	cancelled = true;
+	waitRayTrace();
+
+	progressive = false;
+	progressiveSamples = 0;
+}
+
+void RayTracer::startProgressive(int maximumSamples, float maximumSeconds)
+{
+	stopProgressive();
+
+	if (sceneChanged)
+		buildAccelerator();
+
+	if (progressiveVersion != version)
 	{
-	case AntiAliasingMode::None:
-		for (const auto& task : tasks)
-			rayTrace(task);
-		break;
-	case AntiAliasingMode::Regular:
-		for (const auto& task : tasks)
-			rayTraceRegularAA(task);
-		break;
-	default:
-		assert(0);
-		break;
+		progressiveSamples = 0;
+		progressiveVersion = version;
 	}
+
+	if (maximumSamples > 0 && progressiveSamples >= maximumSamples)
+		return;
+
+	// Only progressive rendering needs the sums, so they are not allocated until it is first used
+	if (accumulation == nullptr)
+	{
+		if (frameBufferFile.empty())
+			accumulation = std::make_unique<FrameBuffer>(width, height, FrameBufferLayout::Tiled);
+		else accumulation = std::make_unique<FrameBuffer>(width, height, FrameBufferLayout::Tiled, frameBufferFile + ".accumulation");
+	}
+	else if (progressiveSamples == 0)
+		accumulation->clear();
+
+	maximumProgressiveSamples = maximumSamples;
+	progressiveDeadline = std::chrono::high_resolution_clock::time_point::max();
+	if (maximumSeconds > 0)
+		progressiveDeadline = std::chrono::high_resolution_clock::now() + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<float>(maximumSeconds));
+
+	progressive = true;
+	createTasks();
+	queueTasks();
+
+	cancelled = false;
+	wakeWorkers(nullptr);
+}
+
+void RayTracer::stopProgressive()
+{
+	progressiveStopping = true;
+	waitRayTrace();
+	progressiveStopping = false;
+
+	progressive = false;
 }
 
 void RayTracer::add(std::unique_ptr<SceneObject> object)
 {
-	sceneObjects.push_back(move(object));
+	cancelRayTrace();
+
+	scene.add(move(object));
+	sceneChanged = true;
+	version++;
+	visibilityVersion++;
 }
 
 void RayTracer::addDirectionLight(const vec4& direction, const vec4& colour)
 {
+	cancelRayTrace();
+
 	lights.push_back(createDirectionLight(normalise(direction), colour));
+	version++;
+	shadowVersion++;
 }
 
 void RayTracer::addPointLight(const vec4& position, const vec4& colour, float attenuation[3])
 {
+	cancelRayTrace();
+
 	lights.push_back(createPointLight(position, colour, attenuation));
+	version++;
+	shadowVersion++;
 }
 
 void RayTracer::clear()
 {
-	sceneObjects.clear();
+	cancelRayTrace();
+	scene.clear();
+	lights.clear();
+	images.clear();
+	sceneChanged = true;
+	version++;
+	visibilityVersion++;
+}
+
+void RayTracer::setMaterial(int object, std::unique_ptr<Material> material)
+{
+	cancelRayTrace();
+
+	// Transparent materials tint the shadows they cast
+	scene.getObject(object)->setMaterial(move(material));
+	version++;
+	shadowVersion++;
+}
+
+void RayTracer::setLight(int index, const Light& light)
+{
+	cancelRayTrace();
+
+	// Colours and attenuation do not change which rays reach the light, so cached shadows stay valid.
+	// A light from getLights keeps its normalised direction as it is, normalising it again could round differently
+	const auto& current = lights[index];
+	const auto moved = light.type != current.type ||
+		(light.type == LightType::Direction && !equal(light.direction.direction, current.direction.direction)) ||
+		(light.type == LightType::Point && !equal(light.point.position, current.point.position));
+
+	lights[index] = light;
+	if (moved)
+	{
+		if (light.type == LightType::Direction)
+			lights[index].direction.direction = normalise(light.direction.direction);
+		shadowVersion++;
+	}
+	version++;
 }
 
 Image* RayTracer::loadTexture(const char* path)
@@ -113,247 +292,1275 @@ Image* RayTracer::loadTexture(const char* path)
 	return image;
 }
 
-void RayTracer::saveBmp(const char* fileName) const
+bool RayTracer::saveBmp(const char* fileName)
+{
+	return writeImage(*frameBuffer, fileName, ImageFormat::Bmp, 8, imageWorkers());
+}
+
+bool RayTracer::saveImage(const char* fileName, int bitDepth)
 {
-	auto data = std::unique_ptr<uint8_t[]>{ new uint8_t[size * size * 3] };
+	ImageFormat format;
+	if (!imageFormatFromFileName(fileName, format))
+		return false;
 
-	for (auto x = 0; x < size; x++)
+	return writeImage(*frameBuffer, fileName, format, bitDepth, imageWorkers());
+}
+
+ImageWorkers RayTracer::imageWorkers()
+{
+	// Progressive refinement would keep the workers busy until its budget ran out
+	stopProgressive();
+
+	return ImageWorkers
 	{
-		for (auto y = 0; y < size; y++)
-		{
-			const auto r = static_cast<uint8_t>(pixelData[(x + y * size) * 3 + 0] * 255);
-			const auto g = static_cast<uint8_t>(pixelData[(x + y * size) * 3 + 1] * 255);
-			const auto b = static_cast<uint8_t>(pixelData[(x + y * size) * 3 + 2] * 255);
+		getThreadCount(),
+		[this](std::function<void()> work) { wakeWorkers(move(work)); },
+		[this] { waitRayTrace(); }
+	};
+}
 
-			data[(x + y * size) * 3 + 0] = r;
-			data[(x + y * size) * 3 + 1] = g;
-			data[(x + y * size) * 3 + 2] = b;
-		}
-	}
+void RayTracer::setAmbientColour(const vec4& value)
+{
+	cancelRayTrace();
 
-	auto saveResult = SOIL_save_image
-	(
-		fileName,
-		SOIL_SAVE_TYPE_BMP,
-		size, size, 3, data.get()
-	);
-	assert(saveResult == 1);
+	ambientColour = value;
+	version++;
 }
 
 void RayTracer::setAntiAliasing(const AntiAliasingController& value)
 {
-	// Wait for raytrace to be done
-	//while (!isRayTraceDone())
-	//{
-	//}
+	cancelRayTrace();
 
 	antiAliasing = value;
+	version++;
+}
+
+void RayTracer::setBackgroundColour(const vec4& value)
+{
+	cancelRayTrace();
+
+	backgroundColour = value;
+	version++;
+}
+
+void RayTracer::setWavefront(bool value)
+{
+	cancelRayTrace();
+
+	wavefront = value;
+	version++;
+}
+
+void RayTracer::setGBufferCaching(bool value)
+{
+	cancelRayTrace();
+
+	gBufferCaching = value;
+	if (!value)
+	{
+		gBuffer.reset();
+		gBufferValid = false;
+	}
+}
+
+void RayTracer::setShadowCaching(bool value)
+{
+	cancelRayTrace();
+
+	shadowCaching = value;
+	if (!value)
+	{
+		shadowCache.reset();
+		shadowCacheSize = 0;
+		shadowCacheValid = false;
+	}
 }
 
 void RayTracer::setCamera(const Camera& value)
 {
+	cancelRayTrace();
+
 	camera = value;
 	auto cameraMatrix = lookAtLH(vec4{}, camera.direction, camera.up);
 	this->cameraMatrix = inverseTranspose(cameraMatrix);
+	version++;
+	visibilityVersion++;
+}
+
+void RayTracer::setSize(int width, int height)
+{
+	cancelRayTrace();
+
+	// The view keeps its height and widens with the aspect ratio, so pixels stay square
+	const auto viewWidth = WIDTH * width / height;
+	this->width = width;
+	this->height = height;
+	viewLeft = -viewWidth * 0.5f;
+	cellWidth = viewWidth / width;
+	cellHeight = (YMAX - YMIN) / height;
+	cropX = 0;
+	cropY = 0;
+	cropWidth = width;
+	cropHeight = height;
+	createFrameBuffers();
+}
+
+void RayTracer::setCropWindow(int x, int y, int width, int height)
+{
+	const auto left = std::max(x, 0);
+	const auto top = std::max(y, 0);
+	const auto right = std::min(x + width, this->width);
+	const auto bottom = std::min(y + height, this->height);
+	if (right <= left || bottom <= top)
+		throw std::exception();
+
+	cancelRayTrace();
+
+	cropX = left;
+	cropY = top;
+	cropWidth = right - left;
+	cropHeight = bottom - top;
+	version++;
+	visibilityVersion++;
+}
+
+void RayTracer::setFrameBufferFile(const std::string& fileName)
+{
+	cancelRayTrace();
+
+	frameBufferFile = fileName;
+	createFrameBuffers();
 }
 
-void RayTracer::setSize(int size)
+void RayTracer::createFrameBuffers()
 {
-	// Wait for raytrace to be done
-	//while (!isRayTraceDone())
-	//{
-	//}
+	// The old buffers go first, so a mapped file of the same name is not deleted from under the new one
+	frameBuffer.reset();
+	accumulation.reset();
+	gBuffer.reset();
+	gBufferValid = false;
+	if (frameBufferFile.empty())
+		frameBuffer = std::make_unique<FrameBuffer>(width, height, FrameBufferLayout::Tiled);
+	else frameBuffer = std::make_unique<FrameBuffer>(width, height, FrameBufferLayout::Tiled, frameBufferFile);
+	version++;
+	visibilityVersion++;
+
+	std::lock_guard<std::mutex> lock(completedMutex);
+	completedTasks.clear();
+}
+
+void RayTracer::buildAccelerator()
+{
+	boundedObjects.clear();
+	unboundedObjects.clear();
+
+	scene.compile();
+
+	std::vector<BoundingBox> bounds{};
+	for (auto reference : scene.getObjects())
+	{
+		BoundingBox objectBounds{};
+		auto bounded = false;
+		scene.visit(reference, [&objectBounds, &bounded](const auto& object)
+		{
+			bounded = object.getBounds(objectBounds);
+		});
+
+		if (bounded)
+		{
+			boundedObjects.push_back(reference);
+			bounds.push_back(objectBounds);
+		}
+		else unboundedObjects.push_back(reference);
+	}
+
+	BVH binaryBVH{};
+	binaryBVH.build(bounds);
+	bvh.build(binaryBVH);
+	buildSphereBlocks();
+	sceneChanged = false;
+}
+
+// Packs the spheres of each leaf into blocks, leaving the BVH as it is so packets and other objects are not affected
+void RayTracer::buildSphereBlocks()
+{
+	sphereBlocks.clear();
+	objectBlocks.assign(boundedObjects.size(), NOT_IN_BLOCK);
+	// There are never more spheres than bounded objects
+	sphereSlots.assign(boundedObjects.size(), -1);
+
+	const auto& primitives = bvh.getPrimitives();
+	for (const auto& node : bvh.getNodes())
+	{
+		for (auto child = 0; child < SceneBVH::WIDTH; child++)
+		{
+			std::vector<int> leafSpheres{};
+			for (auto i = node.children[child]; i < node.children[child] + node.counts[child]; i++)
+			{
+				if (boundedObjects[primitives[i]].getType() == PrimitiveType::Sphere)
+					leafSpheres.push_back(primitives[i]);
+			}
+
+			// A block only pays for itself with at least two spheres in it
+			for (auto first = 0; first + 1 < static_cast<int>(leafSpheres.size()); first += SphereBlock::SIZE)
+			{
+				const auto blockIndex = static_cast<int>(sphereBlocks.size());
+				sphereBlocks.emplace_back();
+				auto& block = sphereBlocks.back();
+				for (auto lane = 0; lane < SphereBlock::SIZE; lane++)
+				{
+					auto sphere = -1;
+					auto center = vec4{};
+					// Padding has a negative infinite squared radius, which makes its discriminant negative for every ray
+					auto radiusSquared = -std::numeric_limits<float>::infinity();
+					if (first + lane < static_cast<int>(leafSpheres.size()))
+					{
+						const auto object = leafSpheres[first + lane];
+						objectBlocks[object] = lane == 0 ? blockIndex : IN_EARLIER_BLOCK;
+
+						sphere = boundedObjects[object].getIndex();
+						center = scene.getSphere(sphere).getCenter();
+						radiusSquared = scene.getSphere(sphere).getRadius() * scene.getSphere(sphere).getRadius();
+						sphereSlots[sphere] = blockIndex * SphereBlock::SIZE + lane;
+					}
+
+					block.spheres[lane] = sphere;
+					for (auto axis = 0; axis < 3; axis++)
+						block.center[axis][lane] = center[axis];
+					block.radiusSquared[lane] = radiusSquared;
+				}
+			}
+		}
+	}
+}
 
-	this->size = size;
-	cellWidth = (XMAX - XMIN) / size;
-	cellHeight = (YMAX - YMIN) / size;
-	pixelData = std::unique_ptr<float[]>{ new float[size * size * 3] };
+int RayTracer::getSphereSlot(const SceneObject* object) const
+{
+	const auto sphere = scene.getSphereIndex(object);
+	return sphere < 0 ? -1 : sphereSlots[sphere];
 }
 
 //Finds the closest point of intersection of the current ray with scene objects
-bool RayTracer::closestPoint(const Ray& ray, IntersectionResult& result, SceneObject*& hitObject, SceneObject* selfObject) const
+bool RayTracer::closestPoint(const Ray& ray, IntersectionResult& result, const SceneObject*& hitObject, ObjectPart self) const
 {
 	hitObject = nullptr;
+	auto hitPrimitive = 0;
 
-	result.distance = 1.0e+6;
-	for (auto& object : sceneObjects)
+	// Called with each object as its own type, so the tests are direct calls
+	auto intersect = [&ray, &result, &hitObject, &hitPrimitive, self](const auto& object)
 	{
-		if (object.get() == selfObject)
-			continue;
-
-		IntersectionResult tmpResult;
-		const auto hit = object->intersect(ray, tmpResult);
+		float distance;
+		auto primitive = 0;
+		const auto hit = &object == self.object ?
+			object.intersectExcluding(ray, self.primitive, distance, primitive) :
+			object.intersect(ray, distance, primitive);
 		if (hit)
 		{
-			assert(tmpResult.distance >= 0);
-			if (tmpResult.distance < result.distance)
+			assert(distance >= 0);
+			if (distance < result.distance)
 			{
-				result.distance = tmpResult.distance;
-				result.point = tmpResult.point;
-				result.normal = tmpResult.normal;
-				hitObject = object.get();
+				result.distance = distance;
+				hitObject = &object;
+				hitPrimitive = primitive;
 			}
 		}
+	};
+
+	result.distance = 1.0e+6;
+	for (auto object : unboundedObjects)
+		scene.visit(object, intersect);
+
+	// A leaf's spheres are tested together when its first one comes up, leaving out the one the ray starts from
+	const auto selfSlot = getSphereSlot(self.object);
+	bvh.traverse(ray, result.distance, [this, &ray, &result, &hitObject, &hitPrimitive, &intersect, selfSlot](int primitive)
+	{
+		const auto blockIndex = objectBlocks[primitive];
+		if (blockIndex == NOT_IN_BLOCK)
+		{
+			scene.visit(boundedObjects[primitive], intersect);
+			return;
+		}
+
+		if (blockIndex == IN_EARLIER_BLOCK)
+			return;
+
+		const auto& block = sphereBlocks[blockIndex];
+		const auto lane = block.intersectClosest(ray, result.distance, SphereBlock::laneMask(selfSlot, blockIndex));
+		if (lane >= 0)
+		{
+			hitObject = &scene.getSphere(block.spheres[lane]);
+			hitPrimitive = 0;
+		}
+	});
+
+	if (hitObject == nullptr)
+		return false;
+
+	// Only the closest hit needs its point and normal
+	hitObject->calculateSurface(ray, result.distance, hitPrimitive, result);
+	result.primitive = hitPrimitive;
+	return true;
+}
+
+//Finds the closest object hit by each active ray of the packet
+void RayTracer::closestPoints(const RayPacket& packet, int activeRays, const SceneObject** hitObjects) const
+{
+	alignas(16) float initialDistances[RayPacket::SIZE];
+	for (auto i = 0; i < RayPacket::SIZE; i++)
+	{
+		// Inactive rays get a negative distance so they never hit or keep nodes alive
+		initialDistances[i] = (activeRays & (1 << i)) ? 1.0e+6f : -1.0f;
+		hitObjects[i] = nullptr;
 	}
 
-	return hitObject != nullptr;
+	auto distances = _mm_load_ps(initialDistances);
+
+	auto intersect = [&packet, &distances, hitObjects](const auto& object)
+	{
+		const auto objectDistances = object.intersectPacket(packet);
+		const auto closer = _mm_cmplt_ps(objectDistances, distances);
+		const auto mask = _mm_movemask_ps(closer);
+		if (mask == 0)
+			return;
+
+		distances = select(closer, objectDistances, distances);
+		for (auto i = 0; i < RayPacket::SIZE; i++)
+		{
+			if (mask & (1 << i))
+				hitObjects[i] = &object;
+		}
+	};
+
+	for (auto object : unboundedObjects)
+		scene.visit(object, intersect);
+
+	bvh.traversePacket(packet, distances, [this, &intersect](int primitive)
+	{
+		scene.visit(boundedObjects[primitive], intersect);
+	});
+}
+
+int RayTracer::calculateTileSize() const
+{
+	auto samples = 1;
+	if (!progressive && antiAliasing.mode != AntiAliasingMode::None && antiAliasing.mode != AntiAliasingMode::Adaptive)
+		samples = antiAliasing.sampleDivision * antiAliasing.sampleDivision;
+
+	const auto raysPerPixel = samples * (1 + static_cast<int>(lights.size()));
+	const auto minimumTiles = static_cast<int>(threads.size()) * TILES_PER_THREAD;
+
+	auto tileSize = MAX_TILE_SIZE;
+	while (tileSize > MIN_TILE_SIZE)
+	{
+		const auto tilesAcross = (cropX + cropWidth - 1) / tileSize - cropX / tileSize + 1;
+		const auto tilesDown = (cropY + cropHeight - 1) / tileSize - cropY / tileSize + 1;
+		if (tilesAcross * tilesDown >= minimumTiles && tileSize * tileSize * raysPerPixel <= MAX_TILE_RAYS)
+			break;
+
+		tileSize >>= 1;
+	}
+
+	return tileSize;
 }
 
 void RayTracer::createTasks()
 {
-	tasks.resize(size);
+	const auto tileSize = calculateTileSize();
+	const auto firstTileX = cropX / tileSize;
+	const auto firstTileY = cropY / tileSize;
+	const auto lastTileX = (cropX + cropWidth - 1) / tileSize;
+	const auto lastTileY = (cropY + cropHeight - 1) / tileSize;
+
+	tasks.clear();
+	tasks.reserve((lastTileX - firstTileX + 1) * (lastTileY - firstTileY + 1));
 
-	for (auto y = 0; y < size; y++)
+	// Tiles stay on the grid of the whole image and are clipped to the crop window
+	for (auto ty = firstTileY; ty <= lastTileY; ty++)
 	{
-		tasks[y].y = y;
-		tasks[y].pixels = pixelData.get() + y * size * 3;
+		for (auto tx = firstTileX; tx <= lastTileX; tx++)
+		{
+			const auto x = std::max(tx * tileSize, cropX);
+			const auto y = std::max(ty * tileSize, cropY);
+			const auto right = std::min((tx + 1) * tileSize, cropX + cropWidth);
+			const auto bottom = std::min((ty + 1) * tileSize, cropY + cropHeight);
+			tasks.push_back(Task{ x, y, right - x, bottom - y, 0 });
+		}
+	}
+
+	std::sort(tasks.begin(), tasks.end(), [tileSize](const Task& lhs, const Task& rhs)
+	{
+		return mortonCode(lhs.x / tileSize, lhs.y / tileSize) < mortonCode(rhs.x / tileSize, rhs.y / tileSize);
+	});
+
+	std::lock_guard<std::mutex> lock(completedMutex);
+	completedTasks.clear();
+}
+
+void RayTracer::queueTasks()
+{
+	// Each worker starts on a contiguous run of the Z-ordered tiles
+	const auto numberTasks = static_cast<int>(tasks.size());
+	const auto numberQueues = static_cast<int>(queues.size());
+	for (auto i = 0; i < numberQueues; i++)
+	{
+		queues[i]->clear();
+
+		const auto begin = numberTasks * i / numberQueues;
+		const auto end = numberTasks * (i + 1) / numberQueues;
+		for (auto task = begin; task < end; task++)
+			queues[i]->push(task);
 	}
+}
 
-	for (auto i = 0; i < size * size * 3; i++)
-		pixelData[i] = 0;
+// Called by the last worker out of a progressive pass, queues the next pass unless a budget has been reached
+bool RayTracer::continueProgressive()
+{
+	if (cancelled)
+		return false;
+
+	progressiveSamples++;
+	if (progressiveStopping)
+		return false;
+	if (maximumProgressiveSamples > 0 && progressiveSamples >= maximumProgressiveSamples)
+		return false;
+	if (std::chrono::high_resolution_clock::now() >= progressiveDeadline)
+		return false;
+
+	queueTasks();
+	return true;
+}
+
+void RayTracer::wakeWorkers(std::function<void()> function)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = move(function);
+		busyThreads = static_cast<int>(threads.size());
+		generation++;
+	}
+
+	workConditionVariable.notify_all();
+}
+
+bool RayTracer::nextTask(int worker, int& task)
+{
+	if (queues[worker]->pop(task))
+		return true;
+
+	const auto numberQueues = static_cast<int>(queues.size());
+	for (auto i = 1; i < numberQueues; i++)
+	{
+		if (queues[(worker + i) % numberQueues]->steal(task))
+			return true;
+	}
+
+	return false;
+}
+
+Ray RayTracer::createPrimaryRay(int x, int y, float offsetX, float offsetY) const
+{
+	const auto xp = viewLeft + x * cellWidth;
+	const auto yp = YMAX - y * cellHeight;
+
+	const auto direction = vec4{ -(xp + 0.5f * cellWidth + offsetX), yp + 0.5f * cellHeight + offsetY, EDIST, 0 };	//direction of the primary ray
+	return Ray{ camera.position, normalise(cameraMatrix * direction) };
 }
 
 void RayTracer::rayTrace(const Task& task) const
 {
-	const auto yp = YMAX - task.y * cellHeight;
+	// Primary rays are traced as 2x2 packets, lanes past the edge of the tile repeat the first ray and are ignored
+	for (auto y = task.y; y < task.y + task.height; y += 2)
+	{
+		for (auto x = task.x; x < task.x + task.width; x += 2)
+		{
+			Ray rays[RayPacket::SIZE];
+			GBufferSample* samples[RayPacket::SIZE]{};
+			auto activeRays = 0;
+			for (auto i = 0; i < RayPacket::SIZE; i++)
+			{
+				const auto px = x + (i & 1);
+				const auto py = y + (i >> 1);
+				if (px < task.x + task.width && py < task.y + task.height)
+				{
+					rays[i] = createPrimaryRay(px, py, 0, 0);
+					activeRays |= 1 << i;
+					if (fillingGBuffer)
+						samples[i] = &gBuffer[static_cast<size_t>(py) * width + px];
+				}
+				else rays[i] = rays[0];
+			}
+
+			vec4 colours[RayPacket::SIZE];
+			tracePacket(RayPacket{ rays }, activeRays, colours, fillingGBuffer ? samples : nullptr);
+
+			for (auto i = 0; i < RayPacket::SIZE; i++)
+			{
+				if ((activeRays & (1 << i)) == 0)
+					continue;
+
+				frameBuffer->set(x + (i & 1), y + (i >> 1), colours[i]);
+			}
+		}
+	}
+}
+
+// Shades each pixel from its cached primary hit, only rays after the first bounce are traced
+void RayTracer::rayTraceFromGBuffer(const Task& task) const
+{
+	for (auto y = task.y; y < task.y + task.height; y++)
+	{
+		for (auto x = task.x; x < task.x + task.width; x++)
+		{
+			const auto& sample = gBuffer[static_cast<size_t>(y) * width + x];
+			if (sample.object == nullptr)
+			{
+				frameBuffer->set(x, y, backgroundColour);
+				continue;
+			}
 
-	for (auto x = 0; x < size; x++)
+			IntersectionResult result{};
+			result.point = sample.point;
+			result.normal = sample.normal;
+			result.distance = sample.distance;
+			result.primitive = sample.primitive;
+			const auto pixel = static_cast<size_t>(y) * width + x;
+			frameBuffer->set(x, y, shade(createPrimaryRay(x, y, 0, 0), result, sample.object, maximumSteps, getShadows(pixel)));
+		}
+	}
+}
+
+void RayTracer::traceRays(const Ray* rays, int count, vec4* colours) const
+{
+	for (auto first = 0; first < count; first += RayPacket::SIZE)
 	{
-		const auto xp = XMIN + x * cellWidth;
+		const auto numberRays = std::min(count - first, RayPacket::SIZE);
+
+		Ray packetRays[RayPacket::SIZE];
+		for (auto i = 0; i < RayPacket::SIZE; i++)
+			packetRays[i] = rays[first + (i < numberRays ? i : 0)];
+
+		vec4 packetColours[RayPacket::SIZE];
+		tracePacket(RayPacket{ packetRays }, (1 << numberRays) - 1, packetColours);
+		for (auto i = 0; i < numberRays; i++)
+			colours[first + i] = packetColours[i];
+	}
+}
+
+// One of the sampleDivision x sampleDivision rays of a pixel, from the regular grid or the pixel's sampler
+Ray RayTracer::createSupersampleRay(int x, int y, int sample, Sampler& sampler) const
+{
+	if (antiAliasing.mode != AntiAliasingMode::Regular)
+	{
+		float u, v;
+		sampler.sample(sample, u, v);
+		return createSampleRay(x, y, u, v);
+	}
+
+	const auto divisions = antiAliasing.sampleDivision;
+	const auto segments = divisions * 2 + 1;
+	const auto widthAddition = -cellWidth * 0.5f + cellWidth / segments * (sample % divisions * 2 + 1);
+	const auto heightAddition = -cellHeight * 0.5f + cellHeight / segments * (sample / divisions * 2 + 1);
+	return createPrimaryRay(x, y, widthAddition, heightAddition);
+}
+
+void RayTracer::rayTraceSupersampledAA(const Task& task) const
+{
+	const auto divisions2 = antiAliasing.sampleDivision * antiAliasing.sampleDivision;
+
+	for (auto y = task.y; y < task.y + task.height; y++)
+	{
+		for (auto x = task.x; x < task.x + task.width; x++)
+		{
+			auto colour = vec4{};
+			Sampler sampler{ antiAliasing, x, y };
+
+			// Sub-samples of the pixel are traced four at a time
+			Ray rays[RayPacket::SIZE];
+			auto numberRays = 0;
+			auto flush = [this, &rays, &numberRays, &colour]()
+			{
+				for (auto i = numberRays; i < RayPacket::SIZE; i++)
+					rays[i] = rays[0];
+
+				vec4 colours[RayPacket::SIZE];
+				tracePacket(RayPacket{ rays }, (1 << numberRays) - 1, colours);
+				for (auto i = 0; i < numberRays; i++)
+					colour += colours[i];
+
+				numberRays = 0;
+			};
 
-		auto direction = vec4{ -(xp + 0.5f * cellWidth), yp + 0.5f * cellHeight, EDIST, 0 };	//direction of the primary ray
-		direction = cameraMatrix * direction;
+			for (auto sample = 0; sample < divisions2; sample++)
+			{
+				rays[numberRays++] = createSupersampleRay(x, y, sample, sampler);
+				if (numberRays == RayPacket::SIZE)
+					flush();
+			}
 
-		const auto ray = Ray{ camera.position, normalise(direction) };
-		const auto colour = trace(ray, nullptr, maximumSteps); //Trace the primary ray and get the colour value
+			if (numberRays > 0)
+				flush();
 
-		task.pixels[x * 3 + 0] = colour.x;
-		task.pixels[x * 3 + 1] = colour.y;
-		task.pixels[x * 3 + 2] = colour.z;
+			colour /= divisions2;
+
+			frameBuffer->set(x, y, colour);
+		}
 	}
 }
 
-void RayTracer::rayTraceRegularAA(const Task& task) const
+//Ray through a point of pixel (x, y), u and v go from 0 to 1 across and down the pixel
+Ray RayTracer::createSampleRay(int x, int y, float u, float v) const
 {
-	auto divisions = antiAliasing.sampleDivision;
-	auto divisions2 = divisions * divisions;
+	return createPrimaryRay(x, y, (u - 0.5f) * cellWidth, (0.5f - v) * cellHeight);
+}
 
-	auto halfWidth = cellWidth * 0.5f;
-	auto halfHeight = cellHeight * 0.5f;
-	auto segments = divisions * 2 + 1;
-	auto widthAdvance = cellWidth / segments;
-	auto heightAdvance = cellHeight / segments;
+static bool exceedsContrast(const vec4* corners, float threshold)
+{
+	auto minimum = corners[0];
+	auto maximum = corners[0];
+	for (auto i = 1; i < 4; i++)
+	{
+		minimum = _mm_min_ps(minimum, corners[i]);
+		maximum = _mm_max_ps(maximum, corners[i]);
+	}
 
-	const auto yp = YMAX - task.y * cellHeight;
+	const auto contrast = maximum - minimum;
+	return contrast.x > threshold || contrast.y > threshold || contrast.z > threshold;
+}
 
-	auto ray = Ray{ camera.position, vec4{} };
+// Averages a square of the pixel from its corner samples, splitting it into quarters while the corners differ too much.
+// Corners are ordered top left, top right, bottom left, bottom right
+vec4 RayTracer::refineAdaptive(int x, int y, float u, float v, float extent, const vec4* corners, int depth, int& budget) const
+{
+	if (depth == MAX_ADAPTIVE_DEPTH || budget < 5 || !exceedsContrast(corners, antiAliasing.threshold))
+		return (corners[0] + corners[1] + corners[2] + corners[3]) * 0.25f;
 
-	for (auto x = 0; x < size; x++)
+	const auto half = extent * 0.5f;
+	const Ray rays[]
 	{
-		const auto xp = XMIN + x * cellWidth;
+		createSampleRay(x, y, u + half, v),
+		createSampleRay(x, y, u, v + half),
+		createSampleRay(x, y, u + half, v + half),
+		createSampleRay(x, y, u + extent, v + half),
+		createSampleRay(x, y, u + half, v + extent),
+	};
+	budget -= 5;
+
+	vec4 samples[5];
+	traceRays(rays, 5, samples);
+	const auto& top = samples[0];
+	const auto& left = samples[1];
+	const auto& centre = samples[2];
+	const auto& right = samples[3];
+	const auto& bottom = samples[4];
+
+	const vec4 topLeft[] { corners[0], top, left, centre };
+	const vec4 topRight[] { top, corners[1], centre, right };
+	const vec4 bottomLeft[] { left, centre, corners[2], bottom };
+	const vec4 bottomRight[] { centre, right, bottom, corners[3] };
+
+	auto colour = refineAdaptive(x, y, u, v, half, topLeft, depth + 1, budget);
+	colour += refineAdaptive(x, y, u + half, v, half, topRight, depth + 1, budget);
+	colour += refineAdaptive(x, y, u, v + half, half, bottomLeft, depth + 1, budget);
+	colour += refineAdaptive(x, y, u + half, v + half, half, bottomRight, depth + 1, budget);
+	return colour * 0.25f;
+}
 
-		auto colour = vec4{};
-		for (auto ay = 0; ay < divisions; ay++)
+void RayTracer::rayTraceAdaptiveAA(const Task& task) const
+{
+	// Samples at the corners of every pixel are shared with its neighbours, so flat areas cost about one ray per pixel
+	const auto cornersAcross = task.width + 1;
+	const auto numberCorners = cornersAcross * (task.height + 1);
+
+	std::vector<Ray> rays(numberCorners);
+	for (auto y = 0; y <= task.height; y++)
+	{
+		for (auto x = 0; x < cornersAcross; x++)
+			rays[y * cornersAcross + x] = createSampleRay(task.x + x, task.y + y, 0, 0);
+	}
+
+	std::vector<vec4> corners(numberCorners);
+	traceRays(rays.data(), numberCorners, corners.data());
+
+	for (auto y = 0; y < task.height; y++)
+	{
+		for (auto x = 0; x < task.width; x++)
 		{
-			auto heightAddition = -halfHeight + heightAdvance * (ay * 2 + 1);
-			for (auto ax = 0; ax < divisions; ax++)
+			const auto corner = y * cornersAcross + x;
+			const vec4 pixelCorners[]
 			{
-				auto widthAddition = -halfWidth + widthAdvance * (ax * 2 + 1);
-				const auto direction = vec4{ -(xp + 0.5f * cellWidth + widthAddition), yp + 0.5f * cellHeight + heightAddition, EDIST, 0 };
-				ray.direction = normalise(cameraMatrix * direction);
-				colour += trace(ray, nullptr, maximumSteps); //Trace the primary ray and get the colour value
+				corners[corner],
+				corners[corner + 1],
+				corners[corner + cornersAcross],
+				corners[corner + cornersAcross + 1],
+			};
+
+			auto budget = antiAliasing.sampleBudget;
+			const auto colour = refineAdaptive(task.x + x, task.y + y, 0, 0, 1, pixelCorners, 0, budget);
+
+			frameBuffer->set(task.x + x, task.y + y, colour);
+		}
+	}
+}
+
+void RayTracer::rayTraceProgressive(const Task& task) const
+{
+	// Every pass takes the next point of each pixel's Sobol sequence, which stays well spread however many passes are run
+	auto sampling = antiAliasing;
+	sampling.mode = AntiAliasingMode::Sobol;
+	const auto sample = progressiveSamples.load();
+	const auto scale = 1.0f / (sample + 1);
+
+	for (auto y = task.y; y < task.y + task.height; y += 2)
+	{
+		for (auto x = task.x; x < task.x + task.width; x += 2)
+		{
+			Ray rays[RayPacket::SIZE];
+			auto activeRays = 0;
+			for (auto i = 0; i < RayPacket::SIZE; i++)
+			{
+				const auto px = x + (i & 1);
+				const auto py = y + (i >> 1);
+				if (px < task.x + task.width && py < task.y + task.height)
+				{
+					float u, v;
+					Sampler{ sampling, px, py }.sample(sample, u, v);
+					rays[i] = createSampleRay(px, py, u, v);
+					activeRays |= 1 << i;
+				}
+				else rays[i] = rays[0];
+			}
+
+			vec4 colours[RayPacket::SIZE];
+			tracePacket(RayPacket{ rays }, activeRays, colours);
+
+			for (auto i = 0; i < RayPacket::SIZE; i++)
+			{
+				if ((activeRays & (1 << i)) == 0)
+					continue;
+
+				const auto px = x + (i & 1);
+				const auto py = y + (i >> 1);
+				const auto sum = accumulation->get(px, py) + colours[i];
+				accumulation->set(px, py, sum);
+				frameBuffer->set(px, py, sum * scale);
 			}
 		}
+	}
+}
 
-		colour /= divisions2;
-
-		task.pixels[x * 3 + 0] = colour.x;
-		task.pixels[x * 3 + 1] = colour.y;
-		task.pixels[x * 3 + 2] = colour.z;
-	}
-}
-
-//void RayTracer::threadFunc(RayTracer* rayTracer)
-//{
-//	while (rayTracer->running)
-//	{
-//		{
-//			std::unique_lock<std::mutex> lock(rayTracer->mutex);
-//			rayTracer->workConditionVariable.wait(lock, [rayTracer] {return rayTracer->workToDo; });
-//		}
-//		
-//		while (true)
-//		{
-//			auto nextTask = rayTracer->taskPtr++;
-//			if (nextTask >= rayTracer->tasks.size())
-//				break;
-//
-//			const auto& task = rayTracer->tasks[nextTask];
-//
-//			if (rayTracer->antiAliasing)
-//				rayTracer->rayTraceAA(task);
-//			else rayTracer->rayTraceNormal(task);
-//
-//			++rayTracer->tasksDone;
-//		}
-//	}
-//}
-
-vec4 RayTracer::calculateShadows(const Ray& lightRay, SceneObject* selfObject, int step) const
+void RayTracer::rayTraceWavefront(const Task& task) const
 {
-	IntersectionResult result{};
-	SceneObject* hitObject;
-	auto newLightRay = lightRay;
+	const auto supersampled = antiAliasing.mode != AntiAliasingMode::None;
+	const auto divisions2 = supersampled ? antiAliasing.sampleDivision * antiAliasing.sampleDivision : 1;
+
+	// One queue of rays per bounce, primary rays are stored pixel by pixel with their samples together
+	std::vector<std::vector<StreamRay>> levels(maximumSteps);
+	auto& primaryRays = levels[0];
+	primaryRays.reserve(task.width * task.height * divisions2);
+	for (auto y = task.y; y < task.y + task.height; y++)
+	{
+		for (auto x = task.x; x < task.x + task.width; x++)
+		{
+			Sampler sampler{ antiAliasing, x, y };
+			for (auto sample = 0; sample < divisions2; sample++)
+			{
+				StreamRay streamRay{};
+				streamRay.ray = supersampled ? createSupersampleRay(x, y, sample, sampler) : createPrimaryRay(x, y, 0, 0);
+				primaryRays.push_back(streamRay);
+			}
+		}
+	}
+
+	for (auto level = 0; level < maximumSteps && !levels[level].empty(); level++)
+	{
+		auto nextRays = level + 1 < maximumSteps ? &levels[level + 1] : nullptr;
+		traceStream(levels[level], nextRays);
+	}
+
+	// Resolve colours from the deepest bounce back up to the primary rays
+	for (auto level = maximumSteps - 1; level >= 0; level--)
+	{
+		for (auto& streamRay : levels[level])
+		{
+			if (!streamRay.hit)
+			{
+				streamRay.colour = backgroundColour;
+				continue;
+			}
+
+			auto intensity = streamRay.base;
+			if (streamRay.hasSecondary)
+			{
+				const auto& secondary = streamRay.child >= 0 ? levels[level + 1][streamRay.child].colour : streamRay.secondary;
+				intensity += secondary * streamRay.weight;
+			}
+
+			streamRay.colour = saturate(intensity);
+		}
+	}
+
+	auto streamRay = primaryRays.begin();
+	for (auto y = task.y; y < task.y + task.height; y++)
+	{
+		for (auto x = task.x; x < task.x + task.width; x++)
+		{
+			auto colour = vec4{};
+			if (supersampled)
+			{
+				for (auto i = 0; i < divisions2; i++, ++streamRay)
+					colour += streamRay->colour;
+				colour /= divisions2;
+			}
+			else
+			{
+				colour = streamRay->colour;
+				++streamRay;
+			}
+
+			frameBuffer->set(x, y, colour);
+		}
+	}
+}
+
+void RayTracer::traceStream(std::vector<StreamRay>& rays, std::vector<StreamRay>* nextRays) const
+{
+	struct SortKey
+	{
+		PrimitiveType type;
+		const Material* material;
+		int ray;
+	};
+
+	std::vector<IntersectionResult> results(rays.size());
+	std::vector<const SceneObject*> hitObjects(rays.size());
+	std::vector<SortKey> order{};
+	order.reserve(rays.size());
+
+	// Intersection stage
+	for (auto i = 0; i < static_cast<int>(rays.size()); i++)
+	{
+		auto& streamRay = rays[i];
+		streamRay.hit = closestPoint(streamRay.ray, results[i], hitObjects[i], streamRay.self);
+		if (streamRay.hit)
+			order.push_back(SortKey{ hitObjects[i]->getPrimitiveType(), hitObjects[i]->getMaterial(), i });
+	}
+
+	// Group hits by primitive type and material, so shading runs the same code on the same data back to back
+	std::sort(order.begin(), order.end(), [](const SortKey& lhs, const SortKey& rhs)
+	{
+		if (lhs.type != rhs.type)
+			return lhs.type < rhs.type;
+		if (lhs.material != rhs.material)
+			return lhs.material < rhs.material;
+		return lhs.ray < rhs.ray;
+	});
+
+	// Shading stage, generating shadow and secondary rays
+	std::vector<StreamShadowRay> shadowRays{};
+	shadowRays.reserve(order.size() * lights.size());
+	for (const auto& key : order)
+	{
+		auto& streamRay = rays[key.ray];
+		const auto& ray = streamRay.ray;
+		const auto& result = results[key.ray];
+		const auto hitObject = hitObjects[key.ray];
+		const auto material = key.material;
+		const auto colour = material->getColour(result.point, hitObject);
+
+		Ray secondaryRay;
+		const auto refractivity = material->refractivity;
+		if (refractivity != 0)
+		{
+			// Refraction replaces the lit colour entirely, so no shadow or reflection rays are needed
+			streamRay.base = colour;
+			streamRay.weight = 1 - colour.w;
+			streamRay.hasSecondary = true;
+
+			if (refractivity != 1)
+				secondaryRay = hitObject->handleRefraction(ray.direction, result.point, result.normal, refractivity);
+			else secondaryRay = Ray{ result.point, ray.direction };
+		}
+		else
+		{
+			streamRay.base = ambientColour * colour;
+			streamRay.weight = material->reflectivity;
+			streamRay.hasSecondary = material->reflectivity > 0;
+
+			if (streamRay.hasSecondary)
+				secondaryRay = Ray{ result.point, reflect(ray.direction, result.normal) };
+
+			for (const auto& light : lights)
+			{
+				StreamShadowRay shadowRay{};
+				shadowRay.parent = key.ray;
+
+				switch (light.type)
+				{
+				case LightType::Direction:
+				{
+					shadowRay.ray = Ray{ result.point, -light.direction.direction };
+					shadowRay.maxDistance = std::numeric_limits<float>::infinity();
+
+					const auto diffuseResult = saturate(dot(-light.direction.direction, result.normal)) * light.direction.colour * colour;
+
+					const auto reflectionVector = reflect(light.direction.direction, result.normal);
+					float specularResult;
+					if (material->specularity == 0)
+						specularResult = 0;
+					else specularResult = powf(std::max(dot(reflectionVector, -ray.direction), 0.0f), material->specularity);
+
+					shadowRay.light = diffuseResult + specularResult;
+					break;
+				}
+				case LightType::Point:
+				{
+					const auto difference = light.point.position - result.point;
+					const auto distance = length(difference);
+					const auto direction = normalise(difference);
+					shadowRay.ray = Ray{ result.point, direction };
+					shadowRay.maxDistance = distance;
+
+					const auto attenuation = light.point.attenuation[0] + light.point.attenuation[1] * distance + light.point.attenuation[2] * distance * distance;
+					const auto diffuseResult = saturate(dot(direction, result.normal)) * light.point.colour * colour / attenuation;
+
+					const auto reflectionVector = reflect(-direction, result.normal);
+					float specularResult;
+					if (material->specularity == 0)
+						specularResult = 0;
+					else specularResult = powf(std::max(dot(reflectionVector, -ray.direction), 0.0f), material->specularity);
+
+					shadowRay.light = diffuseResult + specularResult;
+					break;
+				}
+				default:
+					assert(0);
+					break;
+				}
+
+				shadowRays.push_back(shadowRay);
+			}
+		}
+
+		streamRay.child = -1;
+		if (!streamRay.hasSecondary)
+			continue;
+
+		if (nextRays == nullptr)
+		{
+			streamRay.secondary = backgroundColour;
+			continue;
+		}
+
+		streamRay.child = static_cast<int>(nextRays->size());
+
+		StreamRay nextRay{};
+		nextRay.ray = secondaryRay;
+		nextRay.self = ObjectPart{ hitObject, result.primitive };
+		nextRays->push_back(nextRay);
+	}
+
+	// Shadow stage, lights are added in the same order as they were generated for each hit
+	for (const auto& shadowRay : shadowRays)
+	{
+		auto& streamRay = rays[shadowRay.parent];
+		const auto shadowLevel = calculateShadows(shadowRay.ray, shadowRay.maxDistance, ObjectPart{ hitObjects[shadowRay.parent], results[shadowRay.parent].primitive });
+		streamRay.base += shadowRay.light * shadowLevel;
+	}
+}
+
+void RayTracer::runTask(const Task& task) const
+{
+	if (progressive)
+	{
+		rayTraceProgressive(task);
+		return;
+	}
+
+	if (shadingFromGBuffer)
+	{
+		rayTraceFromGBuffer(task);
+		return;
+	}
+
+	// Filling the G-buffer needs the primary hits in pixel order
+	if (fillingGBuffer)
+	{
+		rayTrace(task);
+		return;
+	}
+
+	// Adaptive sampling picks its rays from the colours of earlier ones, so it cannot be queued up front
+	if (wavefront && antiAliasing.mode != AntiAliasingMode::Adaptive)
+	{
+		rayTraceWavefront(task);
+		return;
+	}
+
+	switch (antiAliasing.mode)
+	{
+	case AntiAliasingMode::None:
+		rayTrace(task);
+		break;
+	case AntiAliasingMode::Adaptive:
+		rayTraceAdaptiveAA(task);
+		break;
+	case AntiAliasingMode::Regular:
+	case AntiAliasingMode::Jittered:
+	case AntiAliasingMode::Halton:
+	case AntiAliasingMode::Sobol:
+		rayTraceSupersampledAA(task);
+		break;
+	default:
+		assert(0);
+		break;
+	}
+}
+
+void RayTracer::completeTask(const Task& task)
+{
+	frameBuffer->evict(task.x, task.y, task.width, task.height);
+	if (progressive)
+		accumulation->evict(task.x, task.y, task.width, task.height);
+
+	std::lock_guard<std::mutex> lock(completedMutex);
+	completedTasks.push_back(task);
+}
+
+void RayTracer::takeCompletedTasks(std::vector<Task>& completed)
+{
+	std::lock_guard<std::mutex> lock(completedMutex);
+	completed.insert(completed.end(), completedTasks.begin(), completedTasks.end());
+	completedTasks.clear();
+}
+
+void RayTracer::threadFunc(RayTracer* rayTracer, int worker)
+{
+	auto generation = 0u;
+
+	while (true)
+	{
+		std::function<void()> job{};
+		{
+			std::unique_lock<std::mutex> lock(rayTracer->mutex);
+			rayTracer->workConditionVariable.wait(lock, [rayTracer, generation] { return !rayTracer->running || rayTracer->generation != generation; });
+			if (!rayTracer->running)
+				return;
+
+			generation = rayTracer->generation;
+			job = rayTracer->job;
+		}
+
+		if (job)
+			job();
+
+		auto nextTask = 0;
+		while (!job && !rayTracer->cancelled && rayTracer->nextTask(worker, nextTask))
+		{
+			auto& task = rayTracer->tasks[nextTask];
 
+			const auto start = std::chrono::high_resolution_clock::now();
+			rayTracer->runTask(task);
+			const auto end = std::chrono::high_resolution_clock::now();
+			task.duration = std::chrono::duration_cast<std::chrono::duration<float>>(end - start).count();
+			rayTracer->completeTask(task);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(rayTracer->mutex);
+			if (--rayTracer->busyThreads != 0)
+				continue;
+
+			// The next pass starts under the same lock, so waitRayTrace never sees the gap between passes
+			if (rayTracer->progressive && rayTracer->continueProgressive())
+			{
+				rayTracer->busyThreads = static_cast<int>(rayTracer->threads.size());
+				rayTracer->generation++;
+				rayTracer->workConditionVariable.notify_all();
+				continue;
+			}
+		}
+		rayTracer->doneConditionVariable.notify_all();
+	}
+}
+
+// Finds how much light reaches along the ray before maxDistance.
+// Stops at the first opaque hit, transparent hits filter the light by their colour.
+vec4 RayTracer::calculateShadows(const Ray& lightRay, float maxDistance, ObjectPart self) const
+{
 	vec4 allowedLight{ 1 };
-	while (closestPoint(newLightRay, result, hitObject, selfObject))
+
+	// Whether a hit blocks the light entirely, a transparent one filters it instead
+	auto opaque = [&lightRay, &allowedLight](const SceneObject& object, float distance)
 	{
-		if (step < 0)
-			return allowedLight;
-		step--;
+		const auto material = object.getMaterial();
+		if (!material->isTransparent)
+			return true;
+
+		const auto colour = material->getColour(lightRay.calculatePoint(distance), &object);
+		if (colour.w > 0)
+			allowedLight *= colour / colour.w * (1 - colour.w);
+		return false;
+	};
 
-		const auto material = hitObject->getMaterial();
-		if (material->isTransparent)
+	auto occlude = [&lightRay, maxDistance, self, &opaque](const auto& object)
+	{
+		float distance;
+		auto primitive = 0;
+		const auto hit = &object == self.object ?
+			object.intersectExcluding(lightRay, self.primitive, distance, primitive) :
+			object.intersect(lightRay, distance, primitive);
+		if (!hit || distance >= maxDistance)
+			return false;
+
+		return opaque(object, distance);
+	};
+
+	auto occluded = false;
+	auto occludeReference = [this, &occlude, &occluded](ObjectReference reference)
+	{
+		scene.visit(reference, [&occlude, &occluded](const auto& object)
 		{
-			const auto colour = material->getColour(result.point, hitObject);
-			if (colour.w > 0)
-				allowedLight *= colour / colour.w * (1 - colour.w);
+			occluded = occlude(object);
+		});
+		return occluded;
+	};
 
-			newLightRay.position = result.point;
-			selfObject = hitObject;
+	const auto selfSlot = getSphereSlot(self.object);
+	auto occludeBlock = [this, &lightRay, maxDistance, &opaque, selfSlot](int blockIndex)
+	{
+		const auto& block = sphereBlocks[blockIndex];
+		alignas(32) float distances[SphereBlock::SIZE];
+		const auto mask = block.intersect(lightRay, maxDistance, SphereBlock::laneMask(selfSlot, blockIndex), distances);
+		for (auto lane = 0; lane < SphereBlock::SIZE; lane++)
+		{
+			if ((mask & (1 << lane)) && opaque(scene.getSphere(block.spheres[lane]), distances[lane]))
+				return true;
 		}
-		else return vec4{ 0 };
+		return false;
+	};
+
+	for (auto object : unboundedObjects)
+	{
+		if (occludeReference(object))
+			return vec4{ 0 };
 	}
 
+	occluded = bvh.traverseAny(lightRay, maxDistance, [this, &occludeReference, &occludeBlock](int primitive)
+	{
+		const auto blockIndex = objectBlocks[primitive];
+		if (blockIndex == NOT_IN_BLOCK)
+			return occludeReference(boundedObjects[primitive]);
+
+		return blockIndex != IN_EARLIER_BLOCK && occludeBlock(blockIndex);
+	});
+
+	if (occluded)
+		return vec4{ 0 };
+
 	return allowedLight;
 }
 
-vec4 RayTracer::trace(const Ray& ray, SceneObject* selfObject, int step) const
+uint64_t* RayTracer::getShadows(size_t pixel) const
+{
+	if (!shadingFromShadowCache && !fillingShadowCache)
+		return nullptr;
+
+	return shadowCache.get() + pixel * lights.size();
+}
+
+vec4 RayTracer::cachedShadows(const Ray& lightRay, float maxDistance, ObjectPart self, uint64_t* shadow) const
+{
+	if (shadow == nullptr)
+		return calculateShadows(lightRay, maxDistance, self);
+
+	if (!shadingFromShadowCache)
+	{
+		const auto transmittance = calculateShadows(lightRay, maxDistance, self);
+		*shadow = static_cast<uint64_t>(toHalf(transmittance.x)) |
+			static_cast<uint64_t>(toHalf(transmittance.y)) << 16 |
+			static_cast<uint64_t>(toHalf(transmittance.z)) << 32 |
+			static_cast<uint64_t>(toHalf(transmittance.w)) << 48;
+	}
+
+	// The frame that fills the cache uses the rounded values too, so the image does not change once it is read back
+	return vec4{ fromHalf(static_cast<uint16_t>(*shadow)), fromHalf(static_cast<uint16_t>(*shadow >> 16)), fromHalf(static_cast<uint16_t>(*shadow >> 32)), fromHalf(static_cast<uint16_t>(*shadow >> 48)) };
+}
+
+void RayTracer::tracePacket(const RayPacket& packet, int activeRays, vec4* colours, GBufferSample** samples) const
+{
+	const SceneObject* hitObjects[RayPacket::SIZE];
+	closestPoints(packet, activeRays, hitObjects);
+
+	for (auto i = 0; i < RayPacket::SIZE; i++)
+	{
+		if ((activeRays & (1 << i)) == 0)
+			continue;
+
+		// The packet test can round differently to the single ray test, so its distance is only trusted if that agrees
+		IntersectionResult result{};
+		auto hitObject = hitObjects[i];
+		float distance;
+		auto primitive = 0;
+		if (hitObject != nullptr)
+		{
+			if (hitObject->intersect(packet.rays[i], distance, primitive))
+			{
+				hitObject->calculateSurface(packet.rays[i], distance, primitive, result);
+				result.distance = distance;
+				result.primitive = primitive;
+			}
+			else if (!closestPoint(packet.rays[i], result, hitObject))
+				hitObject = nullptr;
+		}
+
+		if (samples != nullptr)
+		{
+			samples[i]->point = result.point;
+			samples[i]->normal = result.normal;
+			samples[i]->object = hitObject;
+			samples[i]->primitive = result.primitive;
+			samples[i]->distance = result.distance;
+		}
+
+		const auto shadows = samples != nullptr ? getShadows(samples[i] - gBuffer.get()) : nullptr;
+		colours[i] = hitObject != nullptr ? shade(packet.rays[i], result, hitObject, maximumSteps, shadows) : backgroundColour;
+	}
+}
+
+vec4 RayTracer::trace(const Ray& ray, ObjectPart self, int step) const
 {
 	if (step == 0)
 		return backgroundColour;
 
 	// Cast a ray
 	IntersectionResult result{};
-	SceneObject* hitObject;
-	if (!closestPoint(ray, result, hitObject, selfObject))
+	const SceneObject* hitObject;
+	if (!closestPoint(ray, result, hitObject, self))
 		return backgroundColour;
 
+	return shade(ray, result, hitObject, step);
+}
+
+vec4 RayTracer::shade(const Ray& ray, const IntersectionResult& result, const SceneObject* hitObject, int step, uint64_t* shadows) const
+{
 	const auto material = hitObject->getMaterial();
 	const auto colour = material->getColour(result.point, hitObject);
 
 	const auto ambientResult = ambientColour * colour;
+	const auto self = ObjectPart{ hitObject, result.primitive };
 
 	auto intensity = ambientResult;
 
-	for (const auto& light : lights)
+	for (auto lightIndex = 0u; lightIndex < lights.size(); lightIndex++)
 	{
+		const auto& light = lights[lightIndex];
+		const auto shadow = shadows != nullptr ? shadows + lightIndex : nullptr;
 		switch (light.type)
 		{
 		case LightType::Direction:
 		{
 			const Ray lightRay{ result.point, -light.direction.direction };
-			const auto shadowLevel = calculateShadows(lightRay, hitObject, step - 1);
+			const auto shadowLevel = cachedShadows(lightRay, std::numeric_limits<float>::infinity(), self, shadow);
 
 			const auto diffuseResult = saturate(dot(-light.direction.direction, result.normal)) * light.direction.colour * colour;
 
@@ -372,7 +1579,7 @@ vec4 RayTracer::trace(const Ray& ray, SceneObject* selfObject, int step) const
 			const auto distance = length(difference);
 			const auto direction = normalise(difference);
 			const Ray lightRay{ result.point, direction };
-			const auto shadowLevel = calculateShadows(lightRay, hitObject, step - 1);
+			const auto shadowLevel = cachedShadows(lightRay, distance, self, shadow);
 
 			const auto attenuation = light.point.attenuation[0] + light.point.attenuation[1] * distance + light.point.attenuation[2] * distance * distance;
 			const auto diffuseResult = saturate(dot(direction, result.normal)) * light.point.colour * colour / attenuation;
@@ -395,7 +1602,7 @@ vec4 RayTracer::trace(const Ray& ray, SceneObject* selfObject, int step) const
 	if (material->reflectivity > 0)
 	{
 		const Ray reflectionRay{ result.point, reflect(ray.direction, result.normal) };
-		const auto reflectionColour = trace(reflectionRay, hitObject, step - 1);
+		const auto reflectionColour = trace(reflectionRay, self, step - 1);
 		intensity += reflectionColour * material->reflectivity;
 	}
 
@@ -412,7 +1619,7 @@ vec4 RayTracer::trace(const Ray& ray, SceneObject* selfObject, int step) const
 			refractionRay = Ray{ result.point, ray.direction };
 		}
 
-		const auto refractionColour = trace(refractionRay, hitObject, step - 1) * (1 - colour.w);
+		const auto refractionColour = trace(refractionRay, self, step - 1) * (1 - colour.w);
 		intensity = colour + refractionColour;
 	}
 
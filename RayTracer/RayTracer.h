@@ -1,24 +1,54 @@
 #pragma once
 #include "AntiAliasingController.h"
 #include "Camera.h"
+#include "FrameBuffer.h"
 #include "Image.h"
+#include "ImageWriter.h"
 #include "Light.h"
 #include "mat4.h"
+#include "RayStream.h"
+#include "Scene.h"
 #include "SceneObject.h"
+#include "SphereBlock.h"
+#include "WideBVH.h"
+#include "WorkQueue.h"
 
-//#include <atomic>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
 #include <memory>
-//#include <mutex>
-//#include <thread>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+class Sampler;
 struct IntersectionResult;
 struct Ray;
+struct RayPacket;
 
+// A rectangular tile of the image, traced by one worker at a time
 struct Task
 {
+	int x;
 	int y;
-	float* pixels;
+	int width;
+	int height;
+	// Seconds spent tracing this tile in the last frame
+	float duration;
+};
+
+// The primary hit of a pixel, enough to shade it again without tracing the primary ray
+struct GBufferSample : AlignedObject
+{
+	vec4 point;
+	vec4 normal;
+	// Null where the primary ray missed everything
+	const SceneObject* object;
+	int primitive;
+	float distance;
 };
 
 class RayTracer
@@ -27,40 +57,137 @@ public:
 	RayTracer();
 	~RayTracer();
 
-	//void startRayTrace();
+	// Starts tracing the current frame on the worker threads and returns immediately
+	void startRayTrace();
+	// Traces the current frame and blocks until it is done
 	void rayTrace();
+	void waitRayTrace();
+	// Stops the current frame part way through, progressive samples are discarded
+	void cancelRayTrace();
+
+	// Adds passes of one sample per pixel into the accumulation buffer on the worker threads and returns immediately.
+	// Carries on from the samples already taken unless the scene or settings changed since.
+	// Stops at maximumSamples samples per pixel or after maximumSeconds, zero means no limit.
+	void startProgressive(int maximumSamples, float maximumSeconds);
+	// Finishes the current pass and keeps every sample so far for startProgressive to resume from
+	void stopProgressive();
 
 	void add(std::unique_ptr<SceneObject> object);
 	void addDirectionLight(const vec4& direction, const vec4& colour);
 	void addPointLight(const vec4& position, const vec4& colour, float attenuation[3]);
 	void clear();
 
+	int getObjectCount() const { return scene.getObjectCount(); }
+	// Swaps the material of an object, in the order they were added. Only shading changes, so a cached G-buffer stays valid
+	void setMaterial(int object, std::unique_ptr<Material> material);
+	const std::vector<Light>& getLights() const { return lights; }
+	// Replaces a light, in the order they were added. Only shading changes, so a cached G-buffer stays valid
+	void setLight(int index, const Light& light);
+
 	Image* loadTexture(const char* path);
-	void saveBmp(const char* fileName) const;
+	// Waits for the frame being traced and stops progressive refinement, then converts the image on the worker threads.
+	// Returns false if the file could not be written
+	bool saveBmp(const char* fileName);
+	// Picks BMP, PPM, PNG or EXR from the extension, bitDepth is 8 or 16 for PPM and PNG, 16 or 32 for EXR.
+	// Returns false if the format or depth is not supported or the file could not be written
+	bool saveImage(const char* fileName, int bitDepth = 8);
 
-	void setAmbientColour(const vec4& value) { ambientColour = value; }
+	void setAmbientColour(const vec4& value);
 	void setAntiAliasing(const AntiAliasingController& value);
-	void setBackgroundColour(const vec4& value) { backgroundColour = value; }
+	void setBackgroundColour(const vec4& value);
 	void setCamera(const Camera& value);
-	void setSize(int size);
+	// Resets the crop window to the whole image
+	void setSize(int width, int height);
+	// Traces only this rectangle from then on, leaving the rest of the frame buffer as it was so part of an image can be redone.
+	// Clipped to the image, throws if nothing is left
+	void setCropWindow(int x, int y, int width, int height);
+	void clearCropWindow() { setCropWindow(0, 0, width, height); }
+	// Keeps the frame buffer in a memory mapped file of this name instead of RAM, an empty name goes back to RAM.
+	// Finished tiles are written out to the file as they complete, so very large images only keep the tiles in flight resident
+	void setFrameBufferFile(const std::string& fileName);
+	// Traces bounces breadth first, sorting each bounce's hits by primitive type and material
+	void setWavefront(bool value);
+	// Keeps the primary hit of every pixel so frames where only materials, lights or colours changed skip primary rays.
+	// Only used without anti aliasing, where it takes the place of wavefront tracing
+	void setGBufferCaching(bool value);
+	// Also keeps the transmittance towards every light from each cached primary hit, as half floats, so frames where only
+	// light colours, attenuation, materials' shading or the background changed skip the primary hits' shadow rays.
+	// Needs G-buffer caching
+	void setShadowCaching(bool value);
 
-	/*bool isRayTraceDone() const
+	bool isRayTraceDone() const
 	{
-		return tasksDone == tasks.size();
-	}*/
+		return busyThreads == 0;
+	}
 
-	const float* getPixels() const { return pixelData.get(); }
+	const FrameBuffer& getFrameBuffer() const { return *frameBuffer; }
+	// Tiles of the last frame with their timings, only stable once isRayTraceDone()
+	const std::vector<Task>& getTasks() const { return tasks; }
+	// Moves the tiles finished since the last call onto the end of completed, safe to call while tracing
+	void takeCompletedTasks(std::vector<Task>& completed);
 
 	const AntiAliasingController& getAntiAliasing() const { return antiAliasing; }
-	int getSize() const { return size; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	// The rectangle traced by each frame, as a task covering it
+	Task getCropWindow() const { return Task{ cropX, cropY, cropWidth, cropHeight, 0 }; }
+	bool isCropped() const { return cropWidth != width || cropHeight != height; }
+	bool isWavefront() const { return wavefront; }
+	bool isGBufferCaching() const { return gBufferCaching; }
+	bool isShadowCaching() const { return shadowCaching; }
+	bool isProgressive() const { return progressive; }
+	// Samples per pixel in the progressive image so far
+	int getProgressiveSamples() const { return progressiveSamples; }
+	int getThreadCount() const { return static_cast<int>(threads.size()); }
+	// Changes whenever the scene or a setting that affects the image does, so a viewer can tell its image is stale
+	unsigned int getVersion() const { return version; }
 
 private:
-	std::vector<std::unique_ptr<SceneObject>> sceneObjects{};
+	Scene scene{};
+	// Objects in the BVH, indexed by its primitives
+	std::vector<ObjectReference> boundedObjects{};
+	// Objects without finite bounds, tested against every ray
+	std::vector<ObjectReference> unboundedObjects{};
+	// Spheres sharing a leaf of the BVH, which single rays test together. Packets still test them one at a time
+	PrimitiveArray<SphereBlock> sphereBlocks{};
+	// For each object in the BVH, the block it is the first sphere of, NOT_IN_BLOCK or IN_EARLIER_BLOCK
+	std::vector<int> objectBlocks{};
+	// Block and lane of each sphere of the scene as block * SphereBlock::SIZE + lane, -1 for spheres not in a block
+	std::vector<int> sphereSlots{};
+	SceneBVH bvh{};
+	bool sceneChanged = true;
+	unsigned int version = 0;
+	// Changes only with what the primary rays hit: objects, camera, size and crop window
+	unsigned int visibilityVersion = 0;
+	// Changes with anything else that casts or lets through shadows: lights moving, being added or materials
+	unsigned int shadowVersion = 0;
 	std::vector<std::unique_ptr<Image>> images{};
 	std::vector<Light> lights{};
-	std::unique_ptr<float[]> pixelData{};
+	std::unique_ptr<FrameBuffer> frameBuffer{};
+	// Sum of every progressive sample of each pixel, frameBuffer holds the average
+	std::unique_ptr<FrameBuffer> accumulation{};
+	bool gBufferCaching = false;
+	std::unique_ptr<GBufferSample[]> gBuffer{};
+	// Visibility the G-buffer was filled at, only trusted once a whole frame has filled it
+	unsigned int gBufferVersion = 0;
+	bool gBufferValid = false;
+	// How the frame being traced uses the G-buffer
+	bool shadingFromGBuffer = false;
+	bool fillingGBuffer = false;
+	bool shadowCaching = false;
+	// Four half float channels for each light of each pixel, pixel by pixel
+	std::unique_ptr<uint64_t[]> shadowCache{};
+	size_t shadowCacheSize = 0;
+	unsigned int shadowCacheVisibility = 0;
+	unsigned int shadowCacheVersion = 0;
+	bool shadowCacheValid = false;
+	bool shadingFromShadowCache = false;
+	bool fillingShadowCache = false;
 	std::vector<Task> tasks{};
-	//std::vector<std::thread> threads{};
+	std::mutex completedMutex{};
+	std::vector<Task> completedTasks{};
+	std::vector<std::thread> threads{};
+	std::vector<std::unique_ptr<WorkQueue>> queues{};
 
 	Camera camera{};
 
@@ -69,27 +196,82 @@ private:
 
 	AntiAliasingController antiAliasing{};
 	int maximumSteps = 5;
+	bool wavefront = false;
 
-	int size;
+	int width;
+	int height;
+	std::string frameBufferFile{};
+	int cropX;
+	int cropY;
+	int cropWidth;
+	int cropHeight;
+	float viewLeft;
 	float cellWidth;
 	float cellHeight;
 
 	mat4 cameraMatrix;
 
-	/*std::mutex mutex{};
+	std::mutex mutex{};
 	bool running = true;
-	bool workToDo = false;
+	unsigned int generation = 0;
+	// Run once by each worker in place of the queued tasks, when set for a generation
+	std::function<void()> job{};
 	std::condition_variable workConditionVariable{};
-	std::atomic_int taskPtr;
-	std::atomic_int tasksDone;*/
+	std::condition_variable doneConditionVariable{};
+	std::atomic_int busyThreads{ 0 };
+	std::atomic_bool cancelled{ false };
+
+	bool progressive = false;
+	std::atomic_int progressiveSamples{ 0 };
+	// Version the progressive samples were taken at
+	unsigned int progressiveVersion = 0;
+	std::atomic_bool progressiveStopping{ false };
+	int maximumProgressiveSamples = 0;
+	std::chrono::high_resolution_clock::time_point progressiveDeadline{};
 
-	vec4 calculateShadows(const Ray& lightRay, SceneObject* selfObject, int step) const;
-	vec4 trace(const Ray& ray, SceneObject* selfObject, int step) const;
-	bool closestPoint(const Ray& ray, IntersectionResult& result, SceneObject*& hitObject, SceneObject* selfObject = nullptr) const;
+	vec4 calculateShadows(const Ray& lightRay, float maxDistance, ObjectPart self) const;
+	vec4 trace(const Ray& ray, ObjectPart self, int step) const;
+	// Records each active ray's primary hit into samples when given
+	void tracePacket(const RayPacket& packet, int activeRays, vec4* colours, GBufferSample** samples = nullptr) const;
+	// Traces primary rays in packets, count does not need to be a multiple of the packet size
+	void traceRays(const Ray* rays, int count, vec4* colours) const;
+	// Reads or fills the cached transmittance of each light when shadows is given, for a pixel's primary hit
+	vec4 shade(const Ray& ray, const IntersectionResult& result, const SceneObject* hitObject, int step, uint64_t* shadows = nullptr) const;
+	// Reads the transmittance from the cache, or works it out and stores it, when shadow is given
+	vec4 cachedShadows(const Ray& lightRay, float maxDistance, ObjectPart self, uint64_t* shadow) const;
+	// The cached transmittance of each light for a pixel, null when the frame does not use the cache
+	uint64_t* getShadows(size_t pixel) const;
+	void buildAccelerator();
+	void buildSphereBlocks();
+	// Block and lane of an object, or -1 if it is not a sphere in a block
+	int getSphereSlot(const SceneObject* object) const;
+	bool closestPoint(const Ray& ray, IntersectionResult& result, const SceneObject*& hitObject, ObjectPart self = {}) const;
+	void closestPoints(const RayPacket& packet, int activeRays, const SceneObject** hitObjects) const;
 
+	// Replaces the frame buffer for the current size and file, the accumulation buffer is made again when next needed
+	void createFrameBuffers();
+	int calculateTileSize() const;
 	void createTasks();
+	void queueTasks();
+	bool continueProgressive();
+	// Starts a generation on every worker, running job on each of them or tracing the queued tasks when it is empty
+	void wakeWorkers(std::function<void()> function);
+	// The idle workers, for the image writers to convert rows on
+	ImageWorkers imageWorkers();
+	bool nextTask(int worker, int& task);
+	void runTask(const Task& task) const;
+	void completeTask(const Task& task);
+	Ray createPrimaryRay(int x, int y, float offsetX, float offsetY) const;
 	void rayTrace(const Task& task) const;
-	void rayTraceRegularAA(const Task& task) const;
+	void rayTraceFromGBuffer(const Task& task) const;
+	Ray createSupersampleRay(int x, int y, int sample, Sampler& sampler) const;
+	void rayTraceSupersampledAA(const Task& task) const;
+	Ray createSampleRay(int x, int y, float u, float v) const;
+	vec4 refineAdaptive(int x, int y, float u, float v, float extent, const vec4* corners, int depth, int& budget) const;
+	void rayTraceAdaptiveAA(const Task& task) const;
+	void rayTraceProgressive(const Task& task) const;
+	void rayTraceWavefront(const Task& task) const;
+	void traceStream(std::vector<StreamRay>& rays, std::vector<StreamRay>* nextRays) const;
 
-	//static void threadFunc(RayTracer* rayTracer);
+	static void threadFunc(RayTracer* rayTracer, int worker);
 };
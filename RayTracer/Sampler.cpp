@@ -0,0 +1,94 @@
+#include "Sampler.h"
+
+namespace
+{
+	// Integer hash with good avalanche, used to seed and step the per pixel streams
+	uint32_t hash(uint32_t value)
+	{
+		value ^= value >> 16;
+		value *= 0x7feb352du;
+		value ^= value >> 15;
+		value *= 0x846ca68bu;
+		value ^= value >> 16;
+		return value;
+	}
+
+	// Maps the top 24 bits to [0, 1), so the result never rounds up to 1
+	float toUnit(uint32_t bits)
+	{
+		return (bits >> 8) * (1.0f / (1 << 24));
+	}
+
+	uint32_t reverseBits(uint32_t bits)
+	{
+		bits = (bits << 16) | (bits >> 16);
+		bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+		bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+		bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+		bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+		return bits;
+	}
+
+	// Second dimension of the Sobol sequence, the first is the base 2 radical inverse
+	uint32_t sobol2(uint32_t index)
+	{
+		auto result = 0u;
+		for (auto vector = 1u << 31; index != 0; index >>= 1, vector ^= vector >> 1)
+		{
+			if (index & 1)
+				result ^= vector;
+		}
+		return result;
+	}
+
+	float radicalInverse3(uint32_t index)
+	{
+		auto result = 0.0f;
+		auto digit = 1.0f / 3;
+		for (; index != 0; index /= 3, digit /= 3)
+			result += (index % 3) * digit;
+		return result;
+	}
+
+	float wrap(float value)
+	{
+		return value >= 1 ? value - 1 : value;
+	}
+}
+
+Sampler::Sampler(const AntiAliasingController& antiAliasing, int x, int y) :
+	mode{ antiAliasing.mode },
+	divisions{ antiAliasing.sampleDivision },
+	state{ hash(antiAliasing.seed ^ hash(static_cast<uint32_t>(x) ^ hash(static_cast<uint32_t>(y)))) }
+{
+	scrambleU = next();
+	scrambleV = next();
+}
+
+void Sampler::sample(int index, float& u, float& v)
+{
+	switch (mode)
+	{
+	case AntiAliasingMode::Halton:
+		// Each pixel shifts the whole sequence by a random amount, wrapping around the pixel
+		u = wrap(toUnit(reverseBits(index)) + toUnit(scrambleU));
+		v = wrap(radicalInverse3(index) + toUnit(scrambleV));
+		break;
+	case AntiAliasingMode::Sobol:
+		// Xor scrambling keeps the samples stratified in every power of two grid
+		u = toUnit(reverseBits(index) ^ scrambleU);
+		v = toUnit(sobol2(index) ^ scrambleV);
+		break;
+	default:
+		// Jittered: one random point in each cell of a divisions x divisions grid
+		u = (index % divisions + toUnit(next())) / divisions;
+		v = (index / divisions + toUnit(next())) / divisions;
+		break;
+	}
+}
+
+uint32_t Sampler::next()
+{
+	state = hash(state + 0x9e3779b9u);
+	return state;
+}
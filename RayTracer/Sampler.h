@@ -0,0 +1,24 @@
+#pragma once
+#include "AntiAliasingController.h"
+
+#include <cstdint>
+
+// Sample positions inside one pixel for the stochastic anti aliasing modes.
+// Every pixel seeds its own stream from its coordinates, so an image does not depend on the thread count or tile order.
+class Sampler
+{
+public:
+	Sampler(const AntiAliasingController& antiAliasing, int x, int y);
+
+	// Position of a sample, u and v go from 0 to 1 across and down the pixel
+	void sample(int index, float& u, float& v);
+
+private:
+	AntiAliasingMode mode;
+	int divisions;
+	uint32_t state;
+	uint32_t scrambleU;
+	uint32_t scrambleV;
+
+	uint32_t next();
+};
@@ -0,0 +1,105 @@
+#include "Scene.h"
+
+#include <exception>
+#include <functional>
+
+void Scene::add(std::unique_ptr<SceneObject> object)
+{
+	const auto type = object->getPrimitiveType();
+	if (type == PrimitiveType::Unsupported)
+		throw std::exception();
+
+	pending.push_back(PendingObject{ type, move(object) });
+}
+
+void Scene::clear()
+{
+	pending.clear();
+	objects.clear();
+	spheres.clear();
+	planes.clear();
+	triangles.clear();
+	quads.clear();
+	cylinders.clear();
+	cones.clear();
+	tori.clear();
+	meshes.clear();
+	boxes.clear();
+}
+
+void Scene::compile()
+{
+	for (auto& added : pending)
+	{
+		auto& object = *added.object;
+		switch (added.type)
+		{
+		case PrimitiveType::Sphere:
+			append(object, spheres, added.type);
+			break;
+		case PrimitiveType::InfinitePlane:
+			append(object, planes, added.type);
+			break;
+		case PrimitiveType::Triangle:
+			append(object, triangles, added.type);
+			break;
+		case PrimitiveType::Quad:
+			append(object, quads, added.type);
+			break;
+		case PrimitiveType::Cylinder:
+			append(object, cylinders, added.type);
+			break;
+		case PrimitiveType::Cone:
+			append(object, cones, added.type);
+			break;
+		case PrimitiveType::Torus:
+			append(object, tori, added.type);
+			break;
+		case PrimitiveType::TriangleMesh:
+			append(object, meshes, added.type);
+			break;
+		case PrimitiveType::Box:
+			append(object, boxes, added.type);
+			break;
+		case PrimitiveType::Unsupported:
+			break;
+		}
+	}
+
+	pending.clear();
+}
+
+int Scene::getSphereIndex(const SceneObject* object) const
+{
+	// Only spheres live in the sphere array, so an address inside it is one of them
+	const auto address = reinterpret_cast<const char*>(object);
+	const auto begin = reinterpret_cast<const char*>(spheres.data());
+	const auto end = reinterpret_cast<const char*>(spheres.data() + spheres.size());
+	if (std::less<const char*>{}(address, begin) || !std::less<const char*>{}(address, end))
+		return -1;
+
+	return static_cast<int>(static_cast<const Sphere*>(object) - spheres.data());
+}
+
+SceneObject* Scene::getObject(int index)
+{
+	// Objects are compiled in the order they were added, so the pending ones follow the compiled ones
+	const auto compiled = static_cast<int>(objects.size());
+	if (index >= compiled)
+		return pending[index - compiled].object.get();
+
+	SceneObject* result = nullptr;
+	visit(objects[index], [&result](SceneObject& object)
+	{
+		result = &object;
+	});
+	return result;
+}
+
+template<typename T>
+void Scene::append(SceneObject& object, PrimitiveArray<T>& array, PrimitiveType type)
+{
+	// add checked the type, so the object is a T
+	objects.push_back(ObjectReference{ type, static_cast<int>(array.size()) });
+	array.push_back(std::move(static_cast<T&>(object)));
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include "AlignedObject.h"
+#include "Box.h"
+#include "Cone.h"
+#include "Cylinder.h"
+#include "InfinitePlane.h"
+#include "Polygon.h"
+#include "SceneObject.h"
+#include "Sphere.h"
+#include "Torus.h"
+#include "TriangleMesh.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A compiled object as its type in the top bits and its place in that type's array below, one word per object in the accelerator
+class ObjectReference
+{
+public:
+	static constexpr int TYPE_SHIFT = 28;
+
+	ObjectReference(PrimitiveType type, int index) :
+		value{ static_cast<uint32_t>(type) << TYPE_SHIFT | static_cast<uint32_t>(index) }
+	{
+	}
+
+	PrimitiveType getType() const { return static_cast<PrimitiveType>(value >> TYPE_SHIFT); }
+	int getIndex() const { return static_cast<int>(value & ((1u << TYPE_SHIFT) - 1)); }
+
+private:
+	uint32_t value;
+};
+
+template<typename T>
+using PrimitiveArray = std::vector<T, AlignedAllocator<T>>;
+
+// Objects are added one at a time, then compiled into one contiguous array per type.
+// Visiting a reference calls a function with the object as its concrete type, so the tests it makes are direct calls on neighbouring memory
+class Scene
+{
+public:
+	// Throws for objects the scene has no array for
+	void add(std::unique_ptr<SceneObject> object);
+	void clear();
+	// Moves the objects added since the last call into the arrays of their types, which may move the ones already there
+	void compile();
+
+	int getObjectCount() const { return static_cast<int>(objects.size() + pending.size()); }
+	// The object added index-th, whether it has been compiled yet or not. Compiling moves pending objects, so the pointer
+	// is only good until the next compile
+	SceneObject* getObject(int index);
+	// Every compiled object in the order they were added
+	const std::vector<ObjectReference>& getObjects() const { return objects; }
+
+	const Sphere& getSphere(int index) const { return spheres[index]; }
+	// Index of a compiled sphere in its array, -1 for any other object
+	int getSphereIndex(const SceneObject* object) const;
+
+	template<typename Function>
+	void visit(ObjectReference reference, Function&& function) const
+	{
+		dispatch(*this, reference, function);
+	}
+
+	template<typename Function>
+	void visit(ObjectReference reference, Function&& function)
+	{
+		dispatch(*this, reference, function);
+	}
+
+private:
+	struct PendingObject
+	{
+		PrimitiveType type;
+		std::unique_ptr<SceneObject> object;
+	};
+
+	std::vector<PendingObject> pending{};
+	std::vector<ObjectReference> objects{};
+
+	PrimitiveArray<Sphere> spheres{};
+	PrimitiveArray<InfinitePlane> planes{};
+	PrimitiveArray<Polygon<3>> triangles{};
+	PrimitiveArray<Polygon<4>> quads{};
+	PrimitiveArray<Cylinder> cylinders{};
+	PrimitiveArray<Cone> cones{};
+	PrimitiveArray<Torus> tori{};
+	PrimitiveArray<TriangleMesh> meshes{};
+	PrimitiveArray<Box> boxes{};
+
+	template<typename T>
+	void append(SceneObject& object, PrimitiveArray<T>& array, PrimitiveType type);
+
+	template<typename Self, typename Function>
+	static void dispatch(Self& scene, ObjectReference reference, Function& function)
+	{
+		const auto index = reference.getIndex();
+		switch (reference.getType())
+		{
+		case PrimitiveType::Sphere:
+			function(scene.spheres[index]);
+			break;
+		case PrimitiveType::InfinitePlane:
+			function(scene.planes[index]);
+			break;
+		case PrimitiveType::Triangle:
+			function(scene.triangles[index]);
+			break;
+		case PrimitiveType::Quad:
+			function(scene.quads[index]);
+			break;
+		case PrimitiveType::Cylinder:
+			function(scene.cylinders[index]);
+			break;
+		case PrimitiveType::Cone:
+			function(scene.cones[index]);
+			break;
+		case PrimitiveType::Torus:
+			function(scene.tori[index]);
+			break;
+		case PrimitiveType::TriangleMesh:
+			function(scene.meshes[index]);
+			break;
+		case PrimitiveType::Box:
+			function(scene.boxes[index]);
+			break;
+		case PrimitiveType::Unsupported:
+			break;
+		}
+	}
+};
@@ -1,8 +1,12 @@
 #pragma once
 #include "AlignedObject.h"
+#include "BoundingBox.h"
 #include "Material.h"
 #include "Ray.h"
+#include "RayPacket.h"
 #include "vec4.h"
+#include <cstdint>
+#include <limits>
 #include <memory>
 
 struct IntersectionResult
@@ -10,6 +14,34 @@ struct IntersectionResult
 	vec4 point;
 	vec4 normal;
 	float distance;
+	// Part of the object that was hit, as set by intersect
+	int primitive;
+};
+
+// Concrete type of an object, which picks the array a Scene keeps it in
+enum class PrimitiveType : uint32_t
+{
+	Sphere,
+	InfinitePlane,
+	Triangle,
+	Quad,
+	Cylinder,
+	Cone,
+	Torus,
+	TriangleMesh,
+	Box,
+	// Objects a Scene has no array for, such as polygons other than triangles and quads
+	Unsupported,
+};
+
+class SceneObject;
+
+// One part of an object, such as a triangle of a mesh. A ray leaving a surface leaves out only the part it starts on,
+// so objects made of many parts still shadow and reflect themselves
+struct ObjectPart
+{
+	const SceneObject* object;
+	int primitive;
 };
 
 class SceneObject : public AlignedObject
@@ -20,10 +52,41 @@ public:
 	{
 	}
 	virtual ~SceneObject() = default;
+	// Objects are moved into the arrays of their types when the scene is compiled
+	SceneObject(SceneObject&&) = default;
+	SceneObject& operator=(SceneObject&&) = default;
 
-	virtual bool intersect(const Ray& ray, IntersectionResult& result) const = 0;
+	// Finds the distance to the closest hit only, the surface is worked out later for the winning object.
+	// Objects made of many parts, such as meshes, set primitive to the part that was hit
+	virtual bool intersect(const Ray& ray, float& distance, int& primitive) const = 0;
+	// Like intersect, for a ray leaving the excluded part of this object. Single surfaces that cannot be seen again from
+	// any point on them always miss, objects made of many parts test the others
+	virtual bool intersectExcluding(const Ray&, int, float&, int&) const
+	{
+		return false;
+	}
+	// Fills in the point and normal of a hit found by intersect
+	virtual void calculateSurface(const Ray& ray, float distance, int primitive, IntersectionResult& result) const = 0;
+
+	// Returns the distance to the hit for each ray of the packet, infinity where it misses
+	virtual __m128 intersectPacket(const RayPacket& packet) const
+	{
+		alignas(16) float distances[RayPacket::SIZE];
+		for (auto i = 0; i < RayPacket::SIZE; i++)
+		{
+			int primitive;
+			if (!intersect(packet.rays[i], distances[i], primitive))
+				distances[i] = std::numeric_limits<float>::infinity();
+		}
+		return _mm_load_ps(distances);
+	}
 	virtual Ray handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const = 0;
 
+	virtual PrimitiveType getPrimitiveType() const = 0;
+
+	// Returns false for objects that are not finite, such as infinite planes
+	virtual bool getBounds(BoundingBox& bounds) const = 0;
+
 	virtual vec4 getTextureCoordinates(const vec4& hitPoint) const = 0;
 
 	const Material* getMaterial() const
@@ -31,6 +94,11 @@ public:
 		return material.get();
 	}
 
+	void setMaterial(std::unique_ptr<Material> value)
+	{
+		material = move(value);
+	}
+
 private:
 	std::unique_ptr<Material> material{};
 };
@@ -4,31 +4,42 @@
 #include <math.h>
 #include "MathsHelper.h"
 
-bool Sphere::intersect(const Ray& ray, IntersectionResult& result) const
+void Sphere::calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const
 {
-	const auto difference = ray.position - center;
-	const auto b = dot(ray.direction, difference);
-	const auto len = length(difference);
-	const auto c = len * len - radius * radius;
-	const auto discriminant = b * b - c;
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
+	result.normal = normalise(result.point - center);
+}
 
-	if (discriminant <= 0)
-		return false;
+__m128 Sphere::intersectPacket(const RayPacket& packet) const
+{
+	const auto differenceX = _mm_sub_ps(packet.position[0], _mm_set1_ps(center.x));
+	const auto differenceY = _mm_sub_ps(packet.position[1], _mm_set1_ps(center.y));
+	const auto differenceZ = _mm_sub_ps(packet.position[2], _mm_set1_ps(center.z));
 
-	auto t1 = -b - sqrtf(discriminant);
-	auto t2 = -b + sqrtf(discriminant);
-	if (fabs(t1) < std::numeric_limits<float>::epsilon())
-		t1 = -1;
-	if (fabs(t2) < std::numeric_limits<float>::epsilon())
-		t2 = -1;
+	const auto b = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(packet.direction[0], differenceX),
+		_mm_mul_ps(packet.direction[1], differenceY)),
+		_mm_mul_ps(packet.direction[2], differenceZ));
+	const auto lengthSquared = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(differenceX, differenceX),
+		_mm_mul_ps(differenceY, differenceY)),
+		_mm_mul_ps(differenceZ, differenceZ));
+	const auto c = _mm_sub_ps(lengthSquared, _mm_set1_ps(radius * radius));
+	const auto discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
 
-	result.distance = t1 < t2 ? t1 : t2;
-	if (result.distance < 0)
-		return false;
+	const auto root = _mm_sqrt_ps(discriminant);
+	auto t1 = _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), b), root);
+	auto t2 = _mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), b), root);
 
-	result.point = ray.calculatePoint(result.distance);
-	result.normal = normalise(result.point - center);
-	return true;
+	const auto signMask = _mm_set1_ps(-0.0f);
+	const auto epsilon = _mm_set1_ps(std::numeric_limits<float>::epsilon());
+	t1 = select(_mm_cmplt_ps(_mm_andnot_ps(signMask, t1), epsilon), _mm_set1_ps(-1), t1);
+	t2 = select(_mm_cmplt_ps(_mm_andnot_ps(signMask, t2), epsilon), _mm_set1_ps(-1), t2);
+
+	const auto distance = _mm_min_ps(t1, t2);
+	const auto hit = _mm_and_ps(_mm_cmpgt_ps(discriminant, _mm_setzero_ps()), _mm_cmpge_ps(distance, _mm_setzero_ps()));
+	return select(hit, distance, _mm_set1_ps(std::numeric_limits<float>::infinity()));
 }
 
 Ray Sphere::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
@@ -39,6 +50,13 @@ Ray Sphere::handleRefraction(const vec4& direction, const vec4& hitPoint, const
 	return Ray{ secondHitPoint, outsideDirection };
 }
 
+bool Sphere::getBounds(BoundingBox& bounds) const
+{
+	const auto extent = vec4{ radius, radius, radius, 0 };
+	bounds = BoundingBox{ center - extent, center + extent };
+	return true;
+}
+
 vec4 Sphere::getTextureCoordinates(const vec4& hitPoint) const
 {
 	auto normal = normalise(center - hitPoint);
@@ -1,6 +1,9 @@
 #pragma once
 #include "SceneObject.h"
 
+#include <limits>
+#include <math.h>
+
 class alignas(16) Sphere final : public SceneObject
 {
 public:
@@ -11,11 +14,41 @@ public:
 	{
 	}
 
-	bool intersect(const Ray& ray, IntersectionResult& result) const override;
+	// In the header so the scene's per-type loops can inline it
+	bool intersect(const Ray& ray, float& distance, int&) const override
+	{
+		const auto difference = ray.position - center;
+		const auto b = dot(ray.direction, difference);
+		const auto c = lengthSquared(difference) - radius * radius;
+		const auto discriminant = b * b - c;
+
+		if (discriminant <= 0)
+			return false;
+
+		const auto root = sqrtf(discriminant);
+		auto t1 = -b - root;
+		auto t2 = -b + root;
+		if (fabs(t1) < std::numeric_limits<float>::epsilon())
+			t1 = -1;
+		if (fabs(t2) < std::numeric_limits<float>::epsilon())
+			t2 = -1;
+
+		distance = t1 < t2 ? t1 : t2;
+		return !(distance < 0);
+	}
+
+	void calculateSurface(const Ray& ray, float distance, int primitive, IntersectionResult& result) const override;
+	__m128 intersectPacket(const RayPacket& packet) const override;
 	Ray handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const override;
 
+	PrimitiveType getPrimitiveType() const override { return PrimitiveType::Sphere; }
+	bool getBounds(BoundingBox& bounds) const override;
+
 	vec4 getTextureCoordinates(const vec4& hitPoint) const override;
 
+	const vec4& getCenter() const { return center; }
+	float getRadius() const { return radius; }
+
 private:
 	vec4 center;
 	float radius;
@@ -0,0 +1,164 @@
+#pragma once
+#include "Ray.h"
+#include "RayPacket.h"
+
+#include <limits>
+
+// Spheres in SoA form, so one ray is tested against a whole block with a single set of operations.
+// Eight spheres per block when AVX is available, otherwise four
+struct alignas(32) SphereBlock
+{
+#if defined(__AVX__)
+	static constexpr int SIZE = 8;
+#else
+	static constexpr int SIZE = 4;
+#endif
+
+	float center[3][SIZE];
+	float radiusSquared[SIZE];
+	// Index of each sphere in the scene, -1 for the padding after the last one
+	int spheres[SIZE];
+
+	// Returns a mask of the spheres hit in front of the ray and before maxDistance, leaving out the excluded ones,
+	// and sets distances, aligned like the block, to where each of them is hit and infinity for the rest
+	int intersect(const Ray& ray, float maxDistance, int excluded, float* distances) const;
+
+	// Finds the closest sphere hit before distance and lowers distance to it, returns its lane or -1 for a miss
+	int intersectClosest(const Ray& ray, float& distance, int excluded) const;
+
+	// Mask of the lane a slot, block * SIZE + lane, takes in the given block. Zero for other blocks or a slot of -1
+	static int laneMask(int slot, int block)
+	{
+		return slot >= 0 && slot / SIZE == block ? 1 << slot % SIZE : 0;
+	}
+};
+
+// Same steps as Sphere::intersect with one sqrt for both roots, so each lane gives the same answer as the single sphere
+inline int SphereBlock::intersect(const Ray& ray, float maxDistance, int excluded, float* distances) const
+{
+#if defined(__AVX__)
+	// One pass over all eight lanes of the block
+	const auto zero = _mm256_setzero_ps();
+	const auto minusOne = _mm256_set1_ps(-1);
+	const auto signMask = _mm256_set1_ps(-0.0f);
+	const auto epsilon = _mm256_set1_ps(std::numeric_limits<float>::epsilon());
+
+	const auto differenceX = _mm256_sub_ps(_mm256_set1_ps(ray.position.x), _mm256_load_ps(center[0]));
+	const auto differenceY = _mm256_sub_ps(_mm256_set1_ps(ray.position.y), _mm256_load_ps(center[1]));
+	const auto differenceZ = _mm256_sub_ps(_mm256_set1_ps(ray.position.z), _mm256_load_ps(center[2]));
+	const auto directionX = _mm256_set1_ps(ray.direction.x);
+	const auto directionY = _mm256_set1_ps(ray.direction.y);
+	const auto directionZ = _mm256_set1_ps(ray.direction.z);
+
+	const auto b = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(directionX, differenceX),
+		_mm256_mul_ps(directionY, differenceY)),
+		_mm256_mul_ps(directionZ, differenceZ));
+	const auto lengthSquared = _mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(differenceX, differenceX),
+		_mm256_mul_ps(differenceY, differenceY)),
+		_mm256_mul_ps(differenceZ, differenceZ));
+	const auto c = _mm256_sub_ps(lengthSquared, _mm256_load_ps(radiusSquared));
+	const auto discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+
+	const auto root = _mm256_sqrt_ps(discriminant);
+	auto t1 = _mm256_sub_ps(_mm256_sub_ps(zero, b), root);
+	auto t2 = _mm256_add_ps(_mm256_sub_ps(zero, b), root);
+	t1 = _mm256_blendv_ps(t1, minusOne, _mm256_cmp_ps(_mm256_andnot_ps(signMask, t1), epsilon, _CMP_LT_OQ));
+	t2 = _mm256_blendv_ps(t2, minusOne, _mm256_cmp_ps(_mm256_andnot_ps(signMask, t2), epsilon, _CMP_LT_OQ));
+
+	const auto distance = _mm256_min_ps(t1, t2);
+	auto hit = _mm256_cmp_ps(discriminant, zero, _CMP_GT_OQ);
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(distance, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(distance, _mm256_set1_ps(maxDistance), _CMP_LT_OQ));
+
+	_mm256_store_ps(distances, _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), distance, hit));
+	auto mask = _mm256_movemask_ps(hit);
+#else
+	const auto positionX = _mm_set1_ps(ray.position.x);
+	const auto positionY = _mm_set1_ps(ray.position.y);
+	const auto positionZ = _mm_set1_ps(ray.position.z);
+	const auto directionX = _mm_set1_ps(ray.direction.x);
+	const auto directionY = _mm_set1_ps(ray.direction.y);
+	const auto directionZ = _mm_set1_ps(ray.direction.z);
+	const auto zero = _mm_setzero_ps();
+	const auto minusOne = _mm_set1_ps(-1);
+	const auto signMask = _mm_set1_ps(-0.0f);
+	const auto epsilon = _mm_set1_ps(std::numeric_limits<float>::epsilon());
+	const auto infinity = _mm_set1_ps(std::numeric_limits<float>::infinity());
+	const auto maximum = _mm_set1_ps(maxDistance);
+
+	auto mask = 0;
+	for (auto group = 0; group < SIZE; group += 4)
+	{
+		const auto differenceX = _mm_sub_ps(positionX, _mm_load_ps(&center[0][group]));
+		const auto differenceY = _mm_sub_ps(positionY, _mm_load_ps(&center[1][group]));
+		const auto differenceZ = _mm_sub_ps(positionZ, _mm_load_ps(&center[2][group]));
+
+		const auto b = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(directionX, differenceX),
+			_mm_mul_ps(directionY, differenceY)),
+			_mm_mul_ps(directionZ, differenceZ));
+		const auto lengthSquared = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(differenceX, differenceX),
+			_mm_mul_ps(differenceY, differenceY)),
+			_mm_mul_ps(differenceZ, differenceZ));
+		const auto c = _mm_sub_ps(lengthSquared, _mm_load_ps(&radiusSquared[group]));
+		const auto discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+
+		const auto root = _mm_sqrt_ps(discriminant);
+		auto t1 = _mm_sub_ps(_mm_sub_ps(zero, b), root);
+		auto t2 = _mm_add_ps(_mm_sub_ps(zero, b), root);
+		t1 = select(_mm_cmplt_ps(_mm_andnot_ps(signMask, t1), epsilon), minusOne, t1);
+		t2 = select(_mm_cmplt_ps(_mm_andnot_ps(signMask, t2), epsilon), minusOne, t2);
+
+		const auto distance = _mm_min_ps(t1, t2);
+		auto hit = _mm_cmpgt_ps(discriminant, zero);
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(distance, zero));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(distance, maximum));
+
+		_mm_store_ps(distances + group, select(hit, distance, infinity));
+		mask |= _mm_movemask_ps(hit) << group;
+	}
+#endif
+
+	// Only the object a ray leaves from is excluded, so this is rare
+	excluded &= mask;
+	for (auto lane = 0; excluded != 0; lane++, excluded >>= 1)
+	{
+		if (excluded & 1)
+		{
+			distances[lane] = std::numeric_limits<float>::infinity();
+			mask &= ~(1 << lane);
+		}
+	}
+
+	return mask;
+}
+
+inline int SphereBlock::intersectClosest(const Ray& ray, float& distance, int excluded) const
+{
+	alignas(32) float distances[SIZE];
+	const auto mask = intersect(ray, distance, excluded, distances);
+	if (mask == 0)
+		return -1;
+
+	// Misses are infinite, so the minimum over every lane is the closest hit
+	auto closest = _mm_load_ps(distances);
+	for (auto group = 4; group < SIZE; group += 4)
+		closest = _mm_min_ps(closest, _mm_load_ps(distances + group));
+	closest = _mm_min_ps(closest, _mm_shuffle_ps(closest, closest, _MM_SHUFFLE(2, 3, 0, 1)));
+	closest = _mm_min_ps(closest, _mm_shuffle_ps(closest, closest, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	auto lanes = 0;
+	for (auto group = 0; group < SIZE; group += 4)
+		lanes |= _mm_movemask_ps(_mm_cmpeq_ps(_mm_load_ps(distances + group), closest)) << group;
+
+	// The first of equally close spheres wins, as it would testing them one at a time
+	auto lane = 0;
+	while ((lanes & mask & (1 << lane)) == 0)
+		lane++;
+
+	distance = _mm_cvtss_f32(closest);
+	return lane;
+}
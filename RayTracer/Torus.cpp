@@ -1,178 +1,200 @@
 #include "Torus.h"
-#include "MathsHelper.h"
 
-#include <complex>
+#include <algorithm>
+#include <cmath>
+#include <exception>
 
-bool solveQuadratic(float a, float b, float c, float& root)
+// Hits closer than this are taken to be the surface the ray is leaving
+static constexpr float MIN_DISTANCE = 1.0e-4f;
+static constexpr float BOUNDS_PADDING = 1.0e-3f;
+static constexpr int MAX_ITERATIONS = 64;
+
+namespace
 {
-	if (a == 0.0 || fabs(a / b) < 1.0e-6f)
+	double evaluateQuartic(const double coefficients[5], double x)
 	{
-		if (fabs(b) < 1.0e-4f)
-			return false;
-
-		root = -c / b;
-		return true;
+		return (((coefficients[4] * x + coefficients[3]) * x + coefficients[2]) * x + coefficients[1]) * x + coefficients[0];
 	}
 
-	auto discriminant = b * b - 4 * a * c;
-	if (discriminant >= 0)
+	double evaluateQuarticDerivative(const double coefficients[5], double x)
 	{
-		discriminant = sqrtf(discriminant);
-		root = (b + discriminant) * -0.5f / a;
-		return true;
+		return ((4 * coefficients[4] * x + 3 * coefficients[3]) * x + 2 * coefficients[2]) * x + coefficients[1];
 	}
 
-	return false;
-}
-//----------------------------------------------------------------------------
-bool solveCubic(float a, float b, float c, float d, float& root)
-{
-	if (a == 0 || fabs(a / b) < 1.0e-6f)
-		return solveQuadratic(b, c, d, root);
-
-	const auto B = b / a, C = c / a, D = d / a;
-
-	const auto Q = (B * B - C * 3) / 9;
-	const auto QQQ = Q * Q * Q;
-	const auto R = (2 * B * B * B - 9 * B * C + 27 * D) / 54;
-	const auto RR = R * R;
-
-	// 3 real roots
-	if (RR < QQQ)
+	// Real roots of x^3 + b x^2 + c x + d, returns how many there are
+	int solveCubic(double b, double c, double d, double roots[3])
 	{
-		/* This sqrt and division is safe, since RR >= 0, so QQQ > RR,    */
-		/* so QQQ > 0.  The acos is also safe, since RR/QQQ < 1, and      */
-		/* thus R/sqrt(QQQ) < 1.                                     */
-		const auto theta = acosf(R / sqrtf(QQQ));
-		/* This sqrt is safe, since QQQ >= 0, and thus Q >= 0             */
-		auto r1 = -2 * sqrtf(Q);
-		auto r2 = r1;
-		auto r3 = r1;
-		r1 *= cosf(theta / 3);
-		r2 *= cosf((theta + 2 * PI) / 3);
-		r3 *= cosf((theta - 2 * PI) / 3);
-
-		r1 -= B / 3;
-		r2 -= B / 3;
-		r3 -= B / 3;
-
-		root = 1000000;
-
-		if (r1 >= 0) root = r1;
-		if (r2 >= 0 && r2 < root) root = r2;
-		if (r3 >= 0 && r3 < root) root = r3;
-
-		return true;
+		const auto q = (b * b - 3 * c) / 9;
+		const auto r = (2 * b * b * b - 9 * b * c + 27 * d) / 54;
+		const auto qqq = q * q * q;
+
+		if (r * r < qqq)
+		{
+			const auto theta = acos(r / sqrt(qqq));
+			const auto scale = -2 * sqrt(q);
+			const auto pi = 3.14159265358979323846;
+			roots[0] = scale * cos(theta / 3) - b / 3;
+			roots[1] = scale * cos((theta + 2 * pi) / 3) - b / 3;
+			roots[2] = scale * cos((theta - 2 * pi) / 3) - b / 3;
+			return 3;
+		}
+
+		auto a = -cbrt(fabs(r) + sqrt(r * r - qqq));
+		if (r < 0)
+			a = -a;
+		roots[0] = a + (a != 0 ? q / a : 0) - b / 3;
+		return 1;
 	}
-	// 1 real root
 
-	auto A2 = -powf(fabs(c) + sqrtf(RR - QQQ), 1.0f / 3.0f);
-	if (A2 != 0)
+	// Finds the root in [low, high] of a quartic that changes sign between them,
+	// with Newton steps while they stay inside the bracket and bisection when they do not
+	double refineRoot(const double coefficients[5], double low, double high, double lowValue)
 	{
-		if (R < 0)
-			A2 = -A2;
-		root = A2 + Q / A2;
+		auto x = (low + high) / 2;
+		for (auto i = 0; i < MAX_ITERATIONS; i++)
+		{
+			const auto value = evaluateQuartic(coefficients, x);
+			if (value == 0)
+				return x;
+
+			if ((value < 0) == (lowValue < 0))
+				low = x;
+			else high = x;
+
+			const auto derivative = evaluateQuarticDerivative(coefficients, x);
+			auto next = derivative != 0 ? x - value / derivative : low;
+			if (!(next > low && next < high))
+				next = (low + high) / 2;
+
+			if (fabs(next - x) <= 1.0e-9 * (1 + fabs(x)))
+				return next;
+			x = next;
+		}
+
+		return x;
 	}
-	root -= B / 3;
-	return true;
-}
 
-bool solveQuartic(float a, float b, float c, float d, float e, float& root)
-{
-	// When a or (a and b) are magnitudes of order smaller than C,D,E
-	// just ignore them entirely. 
-	if (a == 0 || fabs(a / b) < 1.0e-6f || fabs(a / c) < 1.0e-6f)
-		return solveCubic(b, c, d, e, root);
-
-	const auto aa = a * a;
-	const auto aaa = aa * a;
-	const auto bb = b * b;
-	const auto bbb = bb * b;
-	const auto alpha = -3 * bb / (8 * aa) + c / a;
-	const auto alpha2 = alpha * alpha;
-	const auto beta = bbb / (8 * aaa) + b * c / (-2 * aa) + d / a;
-	const auto gamma = -3 * bbb * b / (256 * aaa * a) + c * bb / (16 * aaa) + b * d / (-4 * aa) + e / a;
-
-	if (beta == 0)
+	// Smallest root of the quartic in [low, high], found by splitting the range where the derivative is zero
+	// so each piece is monotonic and holds at most one root. Returns false if there is none
+	bool solveQuartic(const double coefficients[5], double low, double high, double& root)
 	{
-		root = b / (-4 * a) + sqrtf(0.5f * (-alpha + sqrtf(alpha2 + 4 * gamma)));
-		return true;
-	}
+		double bounds[5];
+		auto count = 0;
+		bounds[count++] = low;
+
+		double turningPoints[3];
+		const auto leading = 4 * coefficients[4];
+		const auto turningCount = solveCubic(3 * coefficients[3] / leading, 2 * coefficients[2] / leading, coefficients[1] / leading, turningPoints);
+		std::sort(turningPoints, turningPoints + turningCount);
+		for (auto i = 0; i < turningCount; i++)
+		{
+			if (turningPoints[i] > low && turningPoints[i] < high)
+				bounds[count++] = turningPoints[i];
+		}
+		bounds[count++] = high;
+
+		auto lowValue = evaluateQuartic(coefficients, bounds[0]);
+		for (auto i = 0; i + 1 < count; i++)
+		{
+			const auto highValue = evaluateQuartic(coefficients, bounds[i + 1]);
+			if (lowValue == 0)
+			{
+				root = bounds[i];
+				return true;
+			}
+
+			if ((lowValue < 0) != (highValue < 0))
+			{
+				root = refineRoot(coefficients, bounds[i], bounds[i + 1], lowValue);
+				return true;
+			}
+
+			lowValue = highValue;
+		}
 
-	const std::complex<float> P = -alpha2 / 12 - gamma;
-	const std::complex<float> Q = -alpha2 * alpha / 108 + alpha * gamma / 3 - beta * beta / 8;
-	const auto R = Q * 0.5f + sqrt(Q * Q * 0.25f + P * P * P / 27.0f);
-	const auto U = pow(R, 1.0f / 3.0f);
-	auto y = -5 * alpha / 6 - U;
-	if (U != 0.0f)
-		y += P / (3.0f * U);
-	const auto W = sqrt(alpha + y + y);
+		return false;
+	}
+}
 
-	auto foundRealRoot = false;
+bool Torus::intersect(const Ray& ray, float& distance, int&) const
+{
+	const auto origin = ray.position - position;
+	const auto& direction = ray.direction;
+
+	// Clip the ray to the bounding sphere and the slab around the ring, most rays miss here without any quartic
+	const auto outerRadius = majorRadius + minorRadius;
+	const auto a = lengthSquared(direction);
+	const auto b = dot(direction, origin);
+	const auto c = lengthSquared(origin) - outerRadius * outerRadius;
+	const auto discriminant = b * b - a * c;
+	if (!(discriminant > 0))
+		return false;
 
-	const auto firstPart = b / (-4 * a);
-	const auto secondPart = -3 * alpha - 2.0f * y;
-	const auto thirdPart = 2.0f * beta / W;
+	const auto root = sqrtf(discriminant);
+	auto near = (-b - root) / a;
+	auto far = (-b + root) / a;
 
-	auto aRoot = firstPart + 0.5f * (-W - sqrt(secondPart + thirdPart));
-	if (fabs(aRoot.imag()) < 1.0e-10f && aRoot.real() >= 0)
+	if (direction.z != 0)
 	{
-		root = aRoot.real();
-		foundRealRoot = true;
-	}
+		auto slabNear = (-minorRadius - origin.z) / direction.z;
+		auto slabFar = (minorRadius - origin.z) / direction.z;
+		if (slabNear > slabFar)
+			std::swap(slabNear, slabFar);
 
-	aRoot = firstPart + 0.5f * (-W + sqrt(secondPart + thirdPart));
-	if (fabs(aRoot.imag()) < 1.0e-10f && aRoot.real() >= 0 && (!foundRealRoot || aRoot.real() < root))
-	{
-		root = aRoot.real();
-		foundRealRoot = true;
+		near = std::max(near, slabNear);
+		far = std::min(far, slabFar);
 	}
+	else if (fabs(origin.z) > minorRadius)
+		return false;
 
-	aRoot = firstPart + 0.5f * (W - sqrt(secondPart - thirdPart));
-	if (fabs(aRoot.imag()) < 1.0e-10f && aRoot.real() >= 0 && (!foundRealRoot || aRoot.real() < root))
-	{
-		root = aRoot.real();
-		foundRealRoot = true;
-	}
+	// Widened a little, hits that graze the bounds can fall just outside them after rounding
+	const auto padding = BOUNDS_PADDING * outerRadius;
+	near = std::max(near - padding, MIN_DISTANCE);
+	far += padding;
+	if (near >= far)
+		return false;
 
-	aRoot = firstPart + 0.5f * (W + sqrt(secondPart - thirdPart));
-	if (fabs(aRoot.imag()) < 1.0e-10f && aRoot.real() >= 0 && (!foundRealRoot || aRoot.real() < root))
+	// (|p|^2 + R^2 - r^2)^2 = 4 R^2 (px^2 + py^2), with p measured from where the ray enters the bounds so the
+	// coefficients stay small and the root is searched for over a short range
+	const double px = origin.x + direction.x * near;
+	const double py = origin.y + direction.y * near;
+	const double pz = origin.z + direction.z * near;
+	const double dx = direction.x;
+	const double dy = direction.y;
+	const double dz = direction.z;
+	const double majorSquared = majorRadius * majorRadius;
+
+	const auto dd = dx * dx + dy * dy + dz * dz;
+	const auto pd = 2 * (px * dx + py * dy + pz * dz);
+	const auto pp = px * px + py * py + pz * pz + majorSquared - static_cast<double>(minorRadius) * minorRadius;
+
+	const double coefficients[5] =
 	{
-		root = aRoot.real();
-		foundRealRoot = true;
-	}
+		pp * pp - 4 * majorSquared * (px * px + py * py),
+		2 * pd * pp - 8 * majorSquared * (px * dx + py * dy),
+		pd * pd + 2 * dd * pp - 4 * majorSquared * (dx * dx + dy * dy),
+		2 * dd * pd,
+		dd * dd,
+	};
+
+	double offset;
+	if (!solveQuartic(coefficients, 0, far - near, offset))
+		return false;
 
-	return foundRealRoot;
+	distance = near + static_cast<float>(offset);
+	return true;
 }
 
-bool Torus::intersect(const Ray& ray, IntersectionResult& result) const
+void Torus::calculateSurface(const Ray& ray, float distance, int, IntersectionResult& result) const
 {
-	const auto EX = (ray.position - position).x;
-	const auto EY = (ray.position - position).y;
-	const auto EZ = (ray.position - position).z;
-	const auto DX = ray.direction.x;
-	const auto DY = ray.direction.y;
-	const auto DZ = ray.direction.z;
-
-	const auto A = majorRadius;
-
-	const auto G = 4 * A * A * (EX * EX + EY * EY);
-	const auto H = 8 * A * A * (DX * EX + DY * EY);
-	const auto I = 4 * A * A * (DX * DX + DY * DY);
-	const auto J = lengthSquared(ray.position);
-	const auto K = 2 * dot(ray.direction, ray.position);
-	const auto L = lengthSquared(ray.direction) + (A * A - minorRadius * minorRadius);
-
-	float root;
-	auto found = solveQuartic(J * J, 2 * J * K, 2 * J * L + K * K - G, 2 * K * L - H, L * L - I, root);
-
-	if (!found || root < 0)
-		return false;
-
-	result.distance = root;
-	result.point = ray.calculatePoint(root);
-	result.normal = vec4{ 0, 1, 0, 0 };
-	return true;
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
+
+	// Gradient of (|p|^2 + R^2 - r^2)^2 - 4 R^2 (px^2 + py^2), halved
+	const auto point = result.point - position;
+	const auto scale = lengthSquared(point) + majorRadius * majorRadius - minorRadius * minorRadius;
+	const auto ring = vec4{ point.x, point.y, 0, 0 } * (2 * majorRadius * majorRadius);
+	result.normal = normalise(point * scale - ring);
 }
 
 Ray Torus::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
@@ -180,8 +202,15 @@ Ray Torus::handleRefraction(const vec4& direction, const vec4& hitPoint, const v
 	throw std::exception();
 }
 
+bool Torus::getBounds(BoundingBox& bounds) const
+{
+	const auto outerRadius = majorRadius + minorRadius;
+	const auto extent = vec4{ outerRadius, outerRadius, minorRadius, 0 };
+	bounds = BoundingBox{ position - extent, position + extent };
+	return true;
+}
+
 vec4 Torus::getTextureCoordinates(const vec4& hitPoint) const
 {
 	throw std::exception();
 }
-
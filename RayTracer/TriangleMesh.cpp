@@ -0,0 +1,191 @@
+#include "TriangleMesh.h"
+
+#include <exception>
+#include <limits>
+
+TriangleMesh::TriangleMesh(MeshData mesh, std::unique_ptr<Material> material) :
+	SceneObject{ move(material) },
+	vertexX{ move(mesh.x) },
+	vertexY{ move(mesh.y) },
+	vertexZ{ move(mesh.z) },
+	indices{ move(mesh.indices) }
+{
+	if (vertexY.size() != vertexX.size() || vertexZ.size() != vertexX.size() || indices.size() % 3 != 0)
+		throw std::exception();
+
+	for (auto index : indices)
+	{
+		if (index < 0 || index >= static_cast<int>(vertexX.size()))
+			throw std::exception();
+	}
+
+	build();
+}
+
+void TriangleMesh::build()
+{
+	const auto numberTriangles = getTriangleCount();
+
+	std::vector<BoundingBox> triangleBounds(numberTriangles);
+	for (auto i = 0; i < numberTriangles; i++)
+	{
+		for (auto corner = 0; corner < 3; corner++)
+			triangleBounds[i].extend(getVertex(indices[i * 3 + corner]));
+		bounds.extend(triangleBounds[i]);
+	}
+
+	// Triangles next to each other in the leaf order of a BVH are close in space, so runs of four make tight blocks
+	BVH triangleBVH{};
+	triangleBVH.build(triangleBounds);
+	const auto& order = triangleBVH.getPrimitives();
+
+	const auto numberBlocks = (numberTriangles + 3) / 4;
+	blocks.resize(numberBlocks);
+	std::vector<BoundingBox> blockBounds(numberBlocks);
+	for (auto i = 0; i < numberBlocks; i++)
+	{
+		auto& block = blocks[i];
+		for (auto lane = 0; lane < 4; lane++)
+		{
+			const auto position = i * 4 + lane;
+			const auto triangle = position < numberTriangles ? order[position] : -1;
+			block.triangles[lane] = triangle;
+
+			auto vertex = vec4{};
+			auto edge1 = vec4{};
+			auto edge2 = vec4{};
+			if (triangle >= 0)
+			{
+				vertex = getVertex(indices[triangle * 3 + 0]);
+				edge1 = getVertex(indices[triangle * 3 + 1]) - vertex;
+				edge2 = getVertex(indices[triangle * 3 + 2]) - vertex;
+				blockBounds[i].extend(triangleBounds[triangle]);
+			}
+
+			for (auto axis = 0; axis < 3; axis++)
+			{
+				block.vertex[axis][lane] = vertex[axis];
+				block.edge1[axis][lane] = edge1[axis];
+				block.edge2[axis][lane] = edge2[axis];
+			}
+		}
+	}
+
+	triangleBVH.clear();
+
+	BVH blockBVH{};
+	blockBVH.build(blockBounds);
+	bvh.build(blockBVH);
+}
+
+bool TriangleMesh::intersect(const Ray& ray, float& distance, int& primitive) const
+{
+	return intersectExcluding(ray, -1, distance, primitive);
+}
+
+bool TriangleMesh::intersectExcluding(const Ray& ray, int excludedPrimitive, float& distance, int& primitive) const
+{
+	auto closest = std::numeric_limits<float>::infinity();
+	bvh.traverse(ray, closest, [this, &ray, excludedPrimitive, &closest, &primitive](int block)
+	{
+		intersectBlock(blocks[block], ray, excludedPrimitive, closest, primitive);
+	});
+
+	distance = closest;
+	return closest < std::numeric_limits<float>::infinity();
+}
+
+// Moller-Trumbore against the four triangles of a block at once
+void TriangleMesh::intersectBlock(const TriangleBlock& block, const Ray& ray, int excluded, float& distance, int& primitive) const
+{
+	const auto directionX = _mm_set1_ps(ray.direction.x);
+	const auto directionY = _mm_set1_ps(ray.direction.y);
+	const auto directionZ = _mm_set1_ps(ray.direction.z);
+
+	const auto edge1X = _mm_load_ps(block.edge1[0]);
+	const auto edge1Y = _mm_load_ps(block.edge1[1]);
+	const auto edge1Z = _mm_load_ps(block.edge1[2]);
+	const auto edge2X = _mm_load_ps(block.edge2[0]);
+	const auto edge2Y = _mm_load_ps(block.edge2[1]);
+	const auto edge2Z = _mm_load_ps(block.edge2[2]);
+
+	// p = direction x edge2
+	const auto pX = _mm_sub_ps(_mm_mul_ps(directionY, edge2Z), _mm_mul_ps(directionZ, edge2Y));
+	const auto pY = _mm_sub_ps(_mm_mul_ps(directionZ, edge2X), _mm_mul_ps(directionX, edge2Z));
+	const auto pZ = _mm_sub_ps(_mm_mul_ps(directionX, edge2Y), _mm_mul_ps(directionY, edge2X));
+
+	const auto determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, pX), _mm_mul_ps(edge1Y, pY)), _mm_mul_ps(edge1Z, pZ));
+	const auto inverseDeterminant = _mm_div_ps(_mm_set1_ps(1), determinant);
+
+	const auto tX = _mm_sub_ps(_mm_set1_ps(ray.position.x), _mm_load_ps(block.vertex[0]));
+	const auto tY = _mm_sub_ps(_mm_set1_ps(ray.position.y), _mm_load_ps(block.vertex[1]));
+	const auto tZ = _mm_sub_ps(_mm_set1_ps(ray.position.z), _mm_load_ps(block.vertex[2]));
+
+	const auto u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tX, pX), _mm_mul_ps(tY, pY)), _mm_mul_ps(tZ, pZ)), inverseDeterminant);
+
+	// q = t x edge1
+	const auto qX = _mm_sub_ps(_mm_mul_ps(tY, edge1Z), _mm_mul_ps(tZ, edge1Y));
+	const auto qY = _mm_sub_ps(_mm_mul_ps(tZ, edge1X), _mm_mul_ps(tX, edge1Z));
+	const auto qZ = _mm_sub_ps(_mm_mul_ps(tX, edge1Y), _mm_mul_ps(tY, edge1X));
+
+	const auto v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, qX), _mm_mul_ps(directionY, qY)), _mm_mul_ps(directionZ, qZ)), inverseDeterminant);
+	const auto t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)), inverseDeterminant);
+
+	// Zero area padding triangles have a zero determinant, which leaves u, v and t as NaN or infinite and fails these tests
+	const auto zero = _mm_setzero_ps();
+	auto hit = _mm_cmpneq_ps(determinant, zero);
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1)));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(t, _mm_set1_ps(std::numeric_limits<float>::epsilon())));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_set1_ps(distance)));
+
+	const auto mask = _mm_movemask_ps(hit);
+	if (mask == 0)
+		return;
+
+	alignas(16) float distances[4];
+	_mm_store_ps(distances, t);
+	for (auto lane = 0; lane < 4; lane++)
+	{
+		if ((mask & (1 << lane)) && distances[lane] < distance && block.triangles[lane] != excluded)
+		{
+			distance = distances[lane];
+			primitive = block.triangles[lane];
+		}
+	}
+}
+
+void TriangleMesh::calculateSurface(const Ray& ray, float distance, int primitive, IntersectionResult& result) const
+{
+	const auto p0 = getVertex(indices[primitive * 3 + 0]);
+	const auto p1 = getVertex(indices[primitive * 3 + 1]);
+	const auto p2 = getVertex(indices[primitive * 3 + 2]);
+
+	result.distance = distance;
+	result.point = ray.calculatePoint(distance);
+
+	// Winding is not consistent between mesh files, so the normal always faces the ray
+	result.normal = normalise(cross(p2 - p0, p1 - p0));
+	if (dot(result.normal, ray.direction) > 0)
+		result.normal = -result.normal;
+}
+
+Ray TriangleMesh::handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const
+{
+	throw std::exception();
+}
+
+bool TriangleMesh::getBounds(BoundingBox& bounds) const
+{
+	if (this->bounds.isEmpty())
+		return false;
+
+	bounds = this->bounds;
+	return true;
+}
+
+vec4 TriangleMesh::getTextureCoordinates(const vec4& hitPoint) const
+{
+	return hitPoint;
+}
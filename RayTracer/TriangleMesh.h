@@ -0,0 +1,51 @@
+#pragma once
+#include "MeshLoader.h"
+#include "SceneObject.h"
+#include "WideBVH.h"
+
+#include <vector>
+
+// Indexed triangles sharing one set of vertices, with their own BVH over blocks of four triangles
+class alignas(16) TriangleMesh final : public SceneObject
+{
+public:
+	TriangleMesh(MeshData mesh, std::unique_ptr<Material> material);
+
+	bool intersect(const Ray& ray, float& distance, int& primitive) const override;
+	bool intersectExcluding(const Ray& ray, int excludedPrimitive, float& distance, int& primitive) const override;
+	void calculateSurface(const Ray& ray, float distance, int primitive, IntersectionResult& result) const override;
+	Ray handleRefraction(const vec4& direction, const vec4& hitPoint, const vec4& normal, float refractivity) const override;
+
+	PrimitiveType getPrimitiveType() const override { return PrimitiveType::TriangleMesh; }
+	bool getBounds(BoundingBox& bounds) const override;
+
+	vec4 getTextureCoordinates(const vec4& hitPoint) const override;
+
+	int getTriangleCount() const { return static_cast<int>(indices.size() / 3); }
+
+private:
+	// Four triangles in SoA form, as their first vertex and the two edges leaving it
+	struct alignas(16) TriangleBlock
+	{
+		float vertex[3][4];
+		float edge1[3][4];
+		float edge2[3][4];
+		// Index of each triangle, -1 for the zero area padding at the end of the last block
+		int triangles[4];
+	};
+
+	std::vector<float> vertexX;
+	std::vector<float> vertexY;
+	std::vector<float> vertexZ;
+	std::vector<int> indices;
+
+	std::vector<TriangleBlock> blocks{};
+	SceneBVH bvh{};
+	BoundingBox bounds{};
+
+	vec4 getVertex(int index) const { return vec4{ vertexX[index], vertexY[index], vertexZ[index], 0 }; }
+
+	void build();
+	// Triangles numbered excluded are left out, -1 only matches the padding which misses anyway
+	void intersectBlock(const TriangleBlock& block, const Ray& ray, int excluded, float& distance, int& primitive) const;
+};
@@ -0,0 +1,423 @@
+#pragma once
+#include "BVH.h"
+#include "RayPacket.h"
+
+#include <cmath>
+#include <vector>
+
+// Bounding volume hierarchy with width children per node, collapsed from a binary BVH.
+// Child bounds are stored as SoA so one ray is tested against all children with a single set of slab operations.
+template<int width>
+class WideBVH
+{
+	static_assert(width % 4 == 0, "WideBVH width must be a multiple of the SSE width");
+
+public:
+	static constexpr int WIDTH = width;
+
+	struct alignas(16) Node
+	{
+		// Minimum x, y, z followed by maximum x, y, z, one lane per child. Empty children have inverted bounds
+		float bounds[6][width];
+		// Interior children: node index. Leaf children: index of the first primitive
+		int children[width];
+		// Number of primitives of leaf children, zero for interior and empty children
+		int counts[width];
+	};
+
+	void build(const BVH& bvh);
+	void clear();
+
+	// Visits the leaves hit by the ray front to back, skipping any entered after maxDistance.
+	// intersect(primitive) is called for every primitive in those leaves and may lower maxDistance.
+	template<typename Intersector>
+	void traverse(const Ray& ray, float& maxDistance, Intersector intersect) const;
+
+	// Visits the leaves hit by the ray before maxDistance in no particular order.
+	// Stops and returns true as soon as intersect(primitive) returns true.
+	template<typename Intersector>
+	bool traverseAny(const Ray& ray, float maxDistance, Intersector intersect) const;
+
+	// Visits the leaves hit by any ray of the packet, nearest first, skipping any entered after every ray's maxDistances.
+	// intersect(primitive) is called for every primitive in those leaves and may lower maxDistances.
+	template<typename Intersector>
+	void traversePacket(const RayPacket& packet, __m128& maxDistances, Intersector intersect) const;
+
+	const std::vector<Node>& getNodes() const { return nodes; }
+	const std::vector<int>& getPrimitives() const { return primitives; }
+
+private:
+	static constexpr int STACK_SIZE = BVH::MAX_DEPTH * (width - 1) + 1;
+
+	struct TraversalRay
+	{
+		float position[3];
+		float inverseDirection[3];
+		// Row of Node::bounds holding the near and far planes for each axis
+		int nearPlane[3];
+		int farPlane[3];
+
+		explicit TraversalRay(const Ray& ray)
+		{
+			const auto inverse = 1.0f / ray.direction;
+			for (auto axis = 0; axis < 3; axis++)
+			{
+				position[axis] = ray.position[axis];
+				inverseDirection[axis] = inverse[axis];
+
+				// Signbit so that -0 picks the planes matching its infinite inverse
+				const auto negative = std::signbit(ray.direction[axis]);
+				nearPlane[axis] = negative ? axis + 3 : axis;
+				farPlane[axis] = negative ? axis : axis + 3;
+			}
+		}
+	};
+
+	struct StackEntry
+	{
+		int child;
+		int count;
+		float distance;
+	};
+
+	std::vector<Node> nodes{};
+	std::vector<int> primitives{};
+
+	int collapse(const BVH& bvh, int binaryNode);
+
+	// Returns a mask of the children hit by the ray, distances is set to where the ray enters each child
+	static int intersectChildren(const Node& node, const TraversalRay& ray, float maxDistance, float* distances);
+};
+
+// Eight children per node when AVX is available, otherwise four
+#if defined(__AVX__)
+using SceneBVH = WideBVH<8>;
+#else
+using SceneBVH = WideBVH<4>;
+#endif
+
+template<int width>
+void WideBVH<width>::build(const BVH& bvh)
+{
+	clear();
+
+	const auto& binaryNodes = bvh.getNodes();
+	if (binaryNodes.empty())
+		return;
+
+	primitives = bvh.getPrimitives();
+	nodes.reserve(binaryNodes.size() / (width - 1) + 1);
+	collapse(bvh, 0);
+}
+
+template<int width>
+void WideBVH<width>::clear()
+{
+	nodes.clear();
+	primitives.clear();
+}
+
+template<int width>
+int WideBVH<width>::collapse(const BVH& bvh, int binaryNode)
+{
+	const auto& binaryNodes = bvh.getNodes();
+
+	int slots[width];
+	auto slotCount = 0;
+	if (binaryNodes[binaryNode].count > 0)
+	{
+		// A leaf root still needs a node to hold it
+		slots[slotCount++] = binaryNode;
+	}
+	else
+	{
+		slots[slotCount++] = binaryNode + 1;
+		slots[slotCount++] = binaryNodes[binaryNode].offset;
+	}
+
+	// Pull up grandchildren, opening the largest interior child each time
+	while (slotCount < width)
+	{
+		auto largest = -1;
+		auto largestArea = -1.0f;
+		for (auto i = 0; i < slotCount; i++)
+		{
+			const auto& node = binaryNodes[slots[i]];
+			if (node.count == 0 && node.bounds.surfaceArea() > largestArea)
+			{
+				largest = i;
+				largestArea = node.bounds.surfaceArea();
+			}
+		}
+
+		if (largest < 0)
+			break;
+
+		const auto opened = slots[largest];
+		slots[largest] = opened + 1;
+		slots[slotCount++] = binaryNodes[opened].offset;
+	}
+
+	const auto nodeIndex = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+
+	for (auto i = 0; i < width; i++)
+	{
+		for (auto axis = 0; axis < 3; axis++)
+		{
+			nodes[nodeIndex].bounds[axis][i] = std::numeric_limits<float>::infinity();
+			nodes[nodeIndex].bounds[axis + 3][i] = -std::numeric_limits<float>::infinity();
+		}
+		nodes[nodeIndex].children[i] = -1;
+		nodes[nodeIndex].counts[i] = 0;
+	}
+
+	for (auto i = 0; i < slotCount; i++)
+	{
+		const auto& child = binaryNodes[slots[i]];
+		for (auto axis = 0; axis < 3; axis++)
+		{
+			nodes[nodeIndex].bounds[axis][i] = child.bounds.minimum[axis];
+			nodes[nodeIndex].bounds[axis + 3][i] = child.bounds.maximum[axis];
+		}
+
+		if (child.count > 0)
+		{
+			nodes[nodeIndex].children[i] = child.offset;
+			nodes[nodeIndex].counts[i] = child.count;
+		}
+		else
+		{
+			const auto childIndex = collapse(bvh, slots[i]);
+			nodes[nodeIndex].children[i] = childIndex;
+		}
+	}
+
+	return nodeIndex;
+}
+
+template<int width>
+int WideBVH<width>::intersectChildren(const Node& node, const TraversalRay& ray, float maxDistance, float* distances)
+{
+	const auto positionX = _mm_set1_ps(ray.position[0]);
+	const auto positionY = _mm_set1_ps(ray.position[1]);
+	const auto positionZ = _mm_set1_ps(ray.position[2]);
+	const auto inverseX = _mm_set1_ps(ray.inverseDirection[0]);
+	const auto inverseY = _mm_set1_ps(ray.inverseDirection[1]);
+	const auto inverseZ = _mm_set1_ps(ray.inverseDirection[2]);
+	const auto minimum = _mm_setzero_ps();
+	const auto maximum = _mm_set1_ps(maxDistance);
+
+	auto mask = 0;
+	for (auto group = 0; group < width; group += 4)
+	{
+		const auto nearX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.nearPlane[0]][group]), positionX), inverseX);
+		const auto nearY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.nearPlane[1]][group]), positionY), inverseY);
+		const auto nearZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.nearPlane[2]][group]), positionZ), inverseZ);
+		const auto farX = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.farPlane[0]][group]), positionX), inverseX);
+		const auto farY = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.farPlane[1]][group]), positionY), inverseY);
+		const auto farZ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&node.bounds[ray.farPlane[2]][group]), positionZ), inverseZ);
+
+		const auto near = _mm_max_ps(_mm_max_ps(nearX, nearY), _mm_max_ps(nearZ, minimum));
+		const auto far = _mm_min_ps(_mm_min_ps(farX, farY), _mm_min_ps(farZ, maximum));
+
+		_mm_storeu_ps(distances + group, near);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(near, far)) << group;
+	}
+
+	return mask;
+}
+
+#if defined(__AVX__)
+template<>
+inline int WideBVH<8>::intersectChildren(const Node& node, const TraversalRay& ray, float maxDistance, float* distances)
+{
+	const auto positionX = _mm256_set1_ps(ray.position[0]);
+	const auto positionY = _mm256_set1_ps(ray.position[1]);
+	const auto positionZ = _mm256_set1_ps(ray.position[2]);
+	const auto inverseX = _mm256_set1_ps(ray.inverseDirection[0]);
+	const auto inverseY = _mm256_set1_ps(ray.inverseDirection[1]);
+	const auto inverseZ = _mm256_set1_ps(ray.inverseDirection[2]);
+
+	const auto nearX = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.nearPlane[0]]), positionX), inverseX);
+	const auto nearY = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.nearPlane[1]]), positionY), inverseY);
+	const auto nearZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.nearPlane[2]]), positionZ), inverseZ);
+	const auto farX = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.farPlane[0]]), positionX), inverseX);
+	const auto farY = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.farPlane[1]]), positionY), inverseY);
+	const auto farZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[ray.farPlane[2]]), positionZ), inverseZ);
+
+	const auto near = _mm256_max_ps(_mm256_max_ps(nearX, nearY), _mm256_max_ps(nearZ, _mm256_setzero_ps()));
+	const auto far = _mm256_min_ps(_mm256_min_ps(farX, farY), _mm256_min_ps(farZ, _mm256_set1_ps(maxDistance)));
+
+	_mm256_storeu_ps(distances, near);
+	return _mm256_movemask_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ));
+}
+#endif
+
+template<int width>
+template<typename Intersector>
+void WideBVH<width>::traverse(const Ray& ray, float& maxDistance, Intersector intersect) const
+{
+	// Degenerate directions, such as the zero vector refract() gives on total internal reflection, hit nothing
+	if (nodes.empty() || !(lengthSquared(ray.direction) > 0))
+		return;
+
+	const TraversalRay traversalRay{ ray };
+
+	StackEntry stack[STACK_SIZE];
+	auto stackSize = 0;
+	stack[stackSize++] = StackEntry{ 0, 0, 0 };
+
+	while (stackSize > 0)
+	{
+		const auto entry = stack[--stackSize];
+		if (entry.distance > maxDistance)
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (auto i = entry.child; i < entry.child + entry.count; i++)
+				intersect(primitives[i]);
+			continue;
+		}
+
+		const auto& node = nodes[entry.child];
+
+		float distances[width];
+		const auto mask = intersectChildren(node, traversalRay, maxDistance, distances);
+		if (mask == 0)
+			continue;
+
+		// Order the hit children farthest first so the nearest is popped next
+		StackEntry hits[width];
+		auto hitCount = 0;
+		for (auto i = 0; i < width; i++)
+		{
+			if ((mask & (1 << i)) == 0)
+				continue;
+
+			auto position = hitCount++;
+			while (position > 0 && hits[position - 1].distance < distances[i])
+			{
+				hits[position] = hits[position - 1];
+				position--;
+			}
+			hits[position] = StackEntry{ node.children[i], node.counts[i], distances[i] };
+		}
+
+		for (auto i = 0; i < hitCount; i++)
+			stack[stackSize++] = hits[i];
+	}
+}
+
+template<int width>
+template<typename Intersector>
+bool WideBVH<width>::traverseAny(const Ray& ray, float maxDistance, Intersector intersect) const
+{
+	if (nodes.empty() || !(lengthSquared(ray.direction) > 0))
+		return false;
+
+	const TraversalRay traversalRay{ ray };
+
+	StackEntry stack[STACK_SIZE];
+	auto stackSize = 0;
+	stack[stackSize++] = StackEntry{ 0, 0, 0 };
+
+	while (stackSize > 0)
+	{
+		const auto entry = stack[--stackSize];
+		if (entry.count > 0)
+		{
+			for (auto i = entry.child; i < entry.child + entry.count; i++)
+			{
+				if (intersect(primitives[i]))
+					return true;
+			}
+			continue;
+		}
+
+		const auto& node = nodes[entry.child];
+
+		float distances[width];
+		const auto mask = intersectChildren(node, traversalRay, maxDistance, distances);
+		for (auto i = 0; i < width; i++)
+		{
+			if (mask & (1 << i))
+				stack[stackSize++] = StackEntry{ node.children[i], node.counts[i], distances[i] };
+		}
+	}
+
+	return false;
+}
+
+template<int width>
+template<typename Intersector>
+void WideBVH<width>::traversePacket(const RayPacket& packet, __m128& maxDistances, Intersector intersect) const
+{
+	if (nodes.empty())
+		return;
+
+	// Largest distance of any ray in the packet, nodes entered after it cannot hold a closer hit
+	auto packetMaxDistance = [&maxDistances]()
+	{
+		auto value = _mm_max_ps(maxDistances, _mm_shuffle_ps(maxDistances, maxDistances, _MM_SHUFFLE(2, 3, 0, 1)));
+		value = _mm_max_ps(value, _mm_shuffle_ps(value, value, _MM_SHUFFLE(1, 0, 3, 2)));
+		return _mm_cvtss_f32(value);
+	};
+
+	StackEntry stack[STACK_SIZE];
+	auto stackSize = 0;
+	stack[stackSize++] = StackEntry{ 0, 0, 0 };
+
+	while (stackSize > 0)
+	{
+		const auto entry = stack[--stackSize];
+		if (entry.distance > packetMaxDistance())
+			continue;
+
+		if (entry.count > 0)
+		{
+			for (auto i = entry.child; i < entry.child + entry.count; i++)
+				intersect(primitives[i]);
+			continue;
+		}
+
+		const auto& node = nodes[entry.child];
+
+		StackEntry hits[width];
+		auto hitCount = 0;
+		for (auto i = 0; i < width; i++)
+		{
+			if (node.children[i] < 0)
+				continue;
+
+			// Rays in the packet may point in different directions, so pick the near plane per ray
+			const vec4 minimum{ node.bounds[0][i], node.bounds[1][i], node.bounds[2][i], 0 };
+			const vec4 maximum{ node.bounds[3][i], node.bounds[4][i], node.bounds[5][i], 0 };
+			auto near = _mm_setzero_ps();
+			auto far = maxDistances;
+			packet.slabs(minimum, maximum, near, far);
+
+			const auto hitMask = _mm_cmple_ps(near, far);
+			if (_mm_movemask_ps(hitMask) == 0)
+				continue;
+
+			// Order by the nearest entry of any ray that hits the child
+			auto distance = select(hitMask, near, _mm_set1_ps(std::numeric_limits<float>::infinity()));
+			distance = _mm_min_ps(distance, _mm_shuffle_ps(distance, distance, _MM_SHUFFLE(2, 3, 0, 1)));
+			distance = _mm_min_ps(distance, _mm_shuffle_ps(distance, distance, _MM_SHUFFLE(1, 0, 3, 2)));
+			const auto nearest = _mm_cvtss_f32(distance);
+
+			auto position = hitCount++;
+			while (position > 0 && hits[position - 1].distance < nearest)
+			{
+				hits[position] = hits[position - 1];
+				position--;
+			}
+			hits[position] = StackEntry{ node.children[i], node.counts[i], nearest };
+		}
+
+		for (auto i = 0; i < hitCount; i++)
+			stack[stackSize++] = hits[i];
+	}
+}
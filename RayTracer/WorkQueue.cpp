@@ -0,0 +1,35 @@
+#include "WorkQueue.h"
+
+void WorkQueue::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	tasks.clear();
+}
+
+void WorkQueue::push(int task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	tasks.push_back(task);
+}
+
+bool WorkQueue::pop(int& task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (tasks.empty())
+		return false;
+
+	task = tasks.front();
+	tasks.pop_front();
+	return true;
+}
+
+bool WorkQueue::steal(int& task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (tasks.empty())
+		return false;
+
+	task = tasks.back();
+	tasks.pop_back();
+	return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <deque>
+#include <mutex>
+
+// Queue of task indices owned by a single worker thread.
+// The owner pops from the front, idle workers steal from the back.
+class WorkQueue
+{
+public:
+	void clear();
+	void push(int task);
+
+	bool pop(int& task);
+	bool steal(int& task);
+
+private:
+	std::mutex mutex{};
+	std::deque<int> tasks{};
+};
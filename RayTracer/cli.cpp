@@ -0,0 +1,327 @@
+#include "RayTracer.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include "ImageWriter.h"
+#include "JsonSceneLoader.h"
+
+namespace
+{
+	void printUsage(const char* program)
+	{
+		printf("Usage: %s <scene.json> [options]\n"
+		       "  --size <width[xheight]>\n"
+		       "                         Size of the image in pixels, square when only one number is given (default 512)\n"
+		       "  --crop <x,y,width,height>\n"
+		       "                         Only trace this rectangle, the rest of the image is left black\n"
+		       "  --aa <none|regular|adaptive|jittered|halton|sobol>\n"
+		       "                         Anti aliasing mode (default none)\n"
+		       "  --samples <count>      Samples along each axis of a pixel for the supersampling modes (default 2)\n"
+		       "  --threshold <value>    Colour difference that makes adaptive anti aliasing subdivide (default 0.1)\n"
+		       "  --budget <count>       Most extra rays per pixel for adaptive anti aliasing (default 64)\n"
+		       "  --seed <value>         Seed of the jittered, halton and sobol sample patterns (default 0)\n"
+		       "  --progressive <count>  Add up passes of one sample per pixel, stopping at this many samples\n"
+		       "  --time <seconds>       Add up progressive passes until this much time has passed\n"
+		       "  --wavefront            Trace bounces breadth first\n"
+		       "  --out-of-core <file>   Keep the image in a memory mapped scratch file instead of RAM, for very large images\n"
+		       "  --output <file>        Image to write, as bmp, ppm, png or exr by its extension (default out.bmp)\n"
+		       "  --depth <bits>         Bits per sample, 8 or 16 for ppm and png, 16 or 32 for exr (default 8, 16 for exr)\n",
+		       program);
+	}
+
+	bool equalsIgnoreCase(const char* lhs, const char* rhs)
+	{
+		for (; *lhs != 0 && *rhs != 0; lhs++, rhs++)
+		{
+			if (tolower(*lhs) != tolower(*rhs))
+				return false;
+		}
+
+		return *lhs == *rhs;
+	}
+
+	bool parseAntiAliasingMode(const char* name, AntiAliasingMode& mode)
+	{
+		for (auto i = 0; i < static_cast<int>(AntiAliasingMode::Last); i++)
+		{
+			const auto candidate = static_cast<AntiAliasingMode>(i);
+			if (equalsIgnoreCase(name, antiAliasingModeToString(candidate)))
+			{
+				mode = candidate;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool parsePositive(const char* text, int& value)
+	{
+		char* end;
+		const auto result = strtol(text, &end, 10);
+		if (end == text || *end != 0 || result <= 0 || result > 1 << 16)
+			return false;
+
+		value = static_cast<int>(result);
+		return true;
+	}
+
+	bool parseSize(const char* text, int& width, int& height)
+	{
+		char* end;
+		const auto first = strtol(text, &end, 10);
+		if (end == text || first <= 0 || first > 1 << 16)
+			return false;
+
+		if (*end == 0)
+		{
+			width = height = static_cast<int>(first);
+			return true;
+		}
+
+		if (*end != 'x' && *end != 'X')
+			return false;
+
+		if (!parsePositive(end + 1, height))
+			return false;
+
+		width = static_cast<int>(first);
+		return true;
+	}
+
+	bool parseRectangle(const char* text, int rectangle[4])
+	{
+		for (auto i = 0; i < 4; i++)
+		{
+			char* end;
+			const auto value = strtol(text, &end, 10);
+			if (end == text || value < 0 || value > 1 << 16 || *end != (i < 3 ? ',' : 0))
+				return false;
+
+			rectangle[i] = static_cast<int>(value);
+			text = end + 1;
+		}
+
+		return rectangle[2] > 0 && rectangle[3] > 0;
+	}
+
+	bool parseSeed(const char* text, unsigned int& value)
+	{
+		char* end;
+		const auto result = strtoul(text, &end, 10);
+		if (end == text || *end != 0 || text[0] == '-' || result > 0xffffffffUL)
+			return false;
+
+		value = static_cast<unsigned int>(result);
+		return true;
+	}
+
+	bool parseSeconds(const char* text, float& value)
+	{
+		char* end;
+		const auto result = strtof(text, &end);
+		if (end == text || *end != 0 || !(result > 0))
+			return false;
+
+		value = result;
+		return true;
+	}
+
+	bool parseFraction(const char* text, float& value)
+	{
+		char* end;
+		const auto result = strtof(text, &end);
+		if (end == text || *end != 0 || !(result >= 0 && result <= 1))
+			return false;
+
+		value = result;
+		return true;
+	}
+}
+
+// Renders one frame of a scene to a file without any window, for batch jobs
+int main(int argc, char* argv[])
+{
+	const char* sceneFile = nullptr;
+	const char* outputFile = "out.bmp";
+	auto width = 512;
+	auto height = 512;
+	const char* frameBufferFile = nullptr;
+	auto cropped = false;
+	int crop[4];
+	auto antiAliasing = AntiAliasingController{ AntiAliasingMode::None, 2 };
+	auto wavefront = false;
+	auto progressiveSamples = 0;
+	auto progressiveSeconds = 0.0f;
+	auto bitDepth = 0;
+
+	for (auto i = 1; i < argc; i++)
+	{
+		const auto argument = argv[i];
+
+		if (strcmp(argument, "--help") == 0 || strcmp(argument, "-h") == 0)
+		{
+			printUsage(argv[0]);
+			return 0;
+		}
+
+		if (strcmp(argument, "--wavefront") == 0)
+		{
+			wavefront = true;
+			continue;
+		}
+
+		if (argument[0] != '-')
+		{
+			if (sceneFile != nullptr)
+			{
+				printUsage(argv[0]);
+				return 1;
+			}
+
+			sceneFile = argument;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			fprintf(stderr, "Missing value for %s\n", argument);
+			return 1;
+		}
+
+		const auto value = argv[++i];
+		auto valid = true;
+		if (strcmp(argument, "--size") == 0)
+			valid = parseSize(value, width, height);
+		else if (strcmp(argument, "--crop") == 0)
+			valid = cropped = parseRectangle(value, crop);
+		else if (strcmp(argument, "--aa") == 0)
+			valid = parseAntiAliasingMode(value, antiAliasing.mode);
+		else if (strcmp(argument, "--samples") == 0)
+			valid = parsePositive(value, antiAliasing.sampleDivision);
+		else if (strcmp(argument, "--threshold") == 0)
+			valid = parseFraction(value, antiAliasing.threshold);
+		else if (strcmp(argument, "--budget") == 0)
+			valid = parsePositive(value, antiAliasing.sampleBudget);
+		else if (strcmp(argument, "--seed") == 0)
+			valid = parseSeed(value, antiAliasing.seed);
+		else if (strcmp(argument, "--progressive") == 0)
+			valid = parsePositive(value, progressiveSamples);
+		else if (strcmp(argument, "--time") == 0)
+			valid = parseSeconds(value, progressiveSeconds);
+		else if (strcmp(argument, "--out-of-core") == 0)
+			frameBufferFile = value;
+		else if (strcmp(argument, "--output") == 0)
+			outputFile = value;
+		else if (strcmp(argument, "--depth") == 0)
+			valid = parsePositive(value, bitDepth);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argument);
+			return 1;
+		}
+
+		if (!valid)
+		{
+			fprintf(stderr, "Invalid value %s for %s\n", value, argument);
+			return 1;
+		}
+	}
+
+	if (sceneFile == nullptr)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	ImageFormat format;
+	if (!imageFormatFromFileName(outputFile, format))
+	{
+		fprintf(stderr, "Unknown image format for %s\n", outputFile);
+		return 1;
+	}
+
+	if (bitDepth == 0)
+		bitDepth = format == ImageFormat::Exr ? 16 : 8;
+
+	if (!isBitDepthSupported(format, bitDepth))
+	{
+		fprintf(stderr, "Cannot write %d bit samples to %s\n", bitDepth, outputFile);
+		return 1;
+	}
+
+	RayTracer rayTracer{};
+
+	try
+	{
+		loadSceneJson(&rayTracer, sceneFile);
+	}
+	catch (const std::exception&)
+	{
+		fprintf(stderr, "Could not load scene %s\n", sceneFile);
+		return 1;
+	}
+
+	try
+	{
+		// The file goes first, so the full size buffer is never allocated in memory
+		if (frameBufferFile != nullptr)
+			rayTracer.setFrameBufferFile(frameBufferFile);
+		rayTracer.setSize(width, height);
+	}
+	catch (const std::exception&)
+	{
+		fprintf(stderr, "Could not allocate a %dx%d frame buffer\n", width, height);
+		return 1;
+	}
+
+	if (cropped)
+	{
+		try
+		{
+			rayTracer.setCropWindow(crop[0], crop[1], crop[2], crop[3]);
+		}
+		catch (const std::exception&)
+		{
+			fprintf(stderr, "Crop window is outside the %dx%d image\n", width, height);
+			return 1;
+		}
+	}
+
+	rayTracer.setAntiAliasing(antiAliasing);
+	rayTracer.setWavefront(wavefront);
+
+	const auto start = std::chrono::high_resolution_clock::now();
+	const auto progressive = progressiveSamples > 0 || progressiveSeconds > 0;
+	if (progressive)
+	{
+		rayTracer.startProgressive(progressiveSamples, progressiveSeconds);
+		rayTracer.waitRayTrace();
+	}
+	else rayTracer.rayTrace();
+	const auto end = std::chrono::high_resolution_clock::now();
+	const auto duration = std::chrono::duration_cast<std::chrono::duration<float>>(end - start).count();
+
+	if (progressive)
+	{
+		printf("Rendered %s at %dx%d, %d progressive samples, on %d threads in %f seconds\n",
+		       sceneFile, width, height, rayTracer.getProgressiveSamples(), rayTracer.getThreadCount(), duration);
+	}
+	else
+	{
+		printf("Rendered %s at %dx%d, anti aliasing %s, on %d threads in %f seconds\n",
+		       sceneFile, width, height, antiAliasingModeToString(antiAliasing.mode), rayTracer.getThreadCount(), duration);
+	}
+
+	if (!rayTracer.saveImage(outputFile, bitDepth))
+	{
+		fprintf(stderr, "Could not write %s\n", outputFile);
+		return 1;
+	}
+
+	return 0;
+}
@@ -1,17 +1,33 @@
 #include "RayTracer.h"
 
 #include <SDL.h>
+#include <SDL_opengl.h>
 
-#if defined(_WIN32)
-#include <Windows.h>
-#endif
-#include <GL/GL.h>
-
+#include <algorithm>
 #include <chrono>
+#include <exception>
 #include "JsonSceneLoader.h"
 
 static RayTracer rayTracer{};
 static GLuint texture{};
+static auto textureWidth = 0;
+static auto textureHeight = 0;
+// Finished tiles are copied through this buffer, so the upload does not have to wait on the texture
+static GLuint pixelBuffer{};
+static std::vector<Task> completedTiles{};
+
+// Buffer objects are past OpenGL 1.1, so are loaded at runtime
+static PFNGLGENBUFFERSPROC glGenBuffersFunction{};
+static PFNGLBINDBUFFERPROC glBindBufferFunction{};
+static PFNGLBUFFERDATAPROC glBufferDataFunction{};
+static PFNGLMAPBUFFERPROC glMapBufferFunction{};
+static PFNGLUNMAPBUFFERPROC glUnmapBufferFunction{};
+
+static auto progressive = false;
+
+// Progressive rendering stops refining once the image has this many samples per pixel
+static constexpr int MAX_PROGRESSIVE_SAMPLES = 1024;
+static constexpr const char* SCENE_FILE = "scene8.json";
 
 void renderString(float x, float y, const char* string)
 {
@@ -21,17 +37,107 @@ void renderString(float x, float y, const char* string)
 	//glutBitmapString(GLUT_BITMAP_TIMES_ROMAN_24, reinterpret_cast<const unsigned char*>(string));
 }
 
-void display()
+// Streams tiles finished since the last call into the texture, returns false if there were none
+bool uploadTiles()
 {
-	//if (rayTracer.isRayTraceDone())
-	//	rayTracer.startRayTrace();
-	const auto start = std::chrono::high_resolution_clock::now();
-	rayTracer.rayTrace();
-	const auto end = std::chrono::high_resolution_clock::now();
-	const auto duration = std::chrono::duration_cast<std::chrono::duration<float>>(end - start).count();
-	printf("Took %f seconds\n", duration);
+	const auto& frameBuffer = rayTracer.getFrameBuffer();
+	const auto width = frameBuffer.getWidth();
+	const auto height = frameBuffer.getHeight();
+	const auto bytes = static_cast<size_t>(width) * height * 4 * sizeof(float);
+
+	completedTiles.clear();
+	if (width != textureWidth || height != textureHeight)
+	{
+		textureWidth = width;
+		textureHeight = height;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+		completedTiles.push_back(Task{ 0, 0, width, height, 0 });
+	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, rayTracer.getSize(), rayTracer.getSize(), 0, GL_RGB, GL_FLOAT, rayTracer.getPixels());
+	rayTracer.takeCompletedTasks(completedTiles);
+	if (completedTiles.empty())
+		return false;
+
+	glBindBufferFunction(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+	// Orphaning the old storage lets the driver finish earlier uploads from it while this one is written
+	glBufferDataFunction(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	const auto mapped = static_cast<float*>(glMapBufferFunction(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+	if (mapped == nullptr)
+	{
+		// Without a mapping the tiles go up from client memory instead
+		glBindBufferFunction(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		std::vector<float> staging{};
+		for (const auto& tile : completedTiles)
+		{
+			if (tile.x + tile.width > width || tile.y + tile.height > height)
+				continue;
+
+			staging.resize(tile.width * tile.height * 4);
+			frameBuffer.read(tile.x, tile.y, tile.width, tile.height, staging.data(), tile.width);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, tile.x, tile.y, tile.width, tile.height, GL_RGBA, GL_FLOAT, staging.data());
+		}
+		return true;
+	}
+
+	// Tiles keep their place in the image, so each one is a rectangle of a full size buffer
+	for (const auto& tile : completedTiles)
+	{
+		if (tile.x + tile.width <= width && tile.y + tile.height <= height)
+			frameBuffer.read(tile.x, tile.y, tile.width, tile.height, mapped + (static_cast<size_t>(tile.y) * width + tile.x) * 4, width);
+	}
+	glUnmapBufferFunction(GL_PIXEL_UNPACK_BUFFER);
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	for (const auto& tile : completedTiles)
+	{
+		if (tile.x + tile.width > width || tile.y + tile.height > height)
+			continue;
+
+		const auto offset = (static_cast<size_t>(tile.y) * width + tile.x) * 4 * sizeof(float);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, tile.x, tile.y, tile.width, tile.height, GL_RGBA, GL_FLOAT, reinterpret_cast<const void*>(offset));
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindBufferFunction(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return true;
+}
+
+// Draws the current image, returns false once it has stopped changing so the caller can wait for input
+bool display()
+{
+	static auto start = std::chrono::high_resolution_clock::now();
+	static auto tracing = false;
+	static auto renderedVersion = rayTracer.getVersion() - 1;
+
+	// A new frame is only traced when something changed, otherwise idle time goes to progressive refinement
+	if (rayTracer.getVersion() != renderedVersion)
+	{
+		renderedVersion = rayTracer.getVersion();
+		start = std::chrono::high_resolution_clock::now();
+		tracing = !progressive;
+		if (progressive)
+			rayTracer.startProgressive(MAX_PROGRESSIVE_SAMPLES, 0);
+		else rayTracer.startRayTrace();
+	}
+	else if (rayTracer.isRayTraceDone())
+	{
+		if (tracing)
+		{
+			const auto end = std::chrono::high_resolution_clock::now();
+			const auto duration = std::chrono::duration_cast<std::chrono::duration<float>>(end - start).count();
+			printf("Took %f seconds\n", duration);
+			tracing = false;
+		}
+
+		// Returns straight away once the sample budget is reached
+		if (progressive)
+			rayTracer.startProgressive(MAX_PROGRESSIVE_SAMPLES, 0);
+	}
+
+	// Tiles finish before the workers go idle, so the last of them are uploaded after isRayTraceDone
+	const auto busy = !rayTracer.isRayTraceDone();
+	const auto changing = uploadTiles() || busy;
 
 	glClear(GL_COLOR_BUFFER_BIT);
 	glBegin(GL_QUADS);
@@ -48,10 +154,16 @@ void display()
 	glEnd();
 
 	char buffer[1024];
-	snprintf(buffer, 1024, "Anti Aliasing (A): %s\nCurrent Size (-/+): %d",
+	snprintf(buffer, 1024, "Anti Aliasing (A): %s\nCurrent Size (-/+): %dx%d\nWavefront (W): %s\nProgressive (P): %s, %d samples",
 			antiAliasingModeToString(rayTracer.getAntiAliasing().mode),
-	         rayTracer.getSize());
+	         rayTracer.getWidth(),
+	         rayTracer.getHeight(),
+	         rayTracer.isWavefront() ? "On" : "Off",
+	         progressive ? "On" : "Off",
+	         rayTracer.getProgressiveSamples());
 	renderString(0.0f, 0.0f, buffer);
+
+	return changing;
 }
 
 void onKey(SDL_Keycode key)
@@ -72,22 +184,45 @@ void onKey(SDL_Keycode key)
 		rayTracer.setAntiAliasing(antiAliasing);
 	}
 
+	if (key == SDLK_w)
+	{
+		rayTracer.setWavefront(!rayTracer.isWavefront());
+	}
+
+	if (key == SDLK_p)
+	{
+		progressive = !progressive;
+		if (!progressive)
+			rayTracer.stopProgressive();
+	}
+
+	if (key == SDLK_r)
+	{
+		// A scene being edited may not load, which leaves it empty until it is fixed and reloaded
+		try
+		{
+			loadSceneJson(&rayTracer, SCENE_FILE);
+		}
+		catch (const std::exception&)
+		{
+			printf("Could not load scene %s\n", SCENE_FILE);
+		}
+	}
+
 	if (key == SDLK_MINUS || key == SDLK_KP_MINUS)
 	{
-		auto size = rayTracer.getSize();
-		size >>= 1;
-		if (size < 16)
-			size = 16;
-		rayTracer.setSize(size);
+		// Halves both sides while the shorter one stays at least 16 pixels, keeping the aspect ratio
+		if (std::min(rayTracer.getWidth(), rayTracer.getHeight()) >= 32)
+			rayTracer.setSize(rayTracer.getWidth() >> 1, rayTracer.getHeight() >> 1);
 	}
 
 	if (key == SDLK_PLUS || key == SDLK_EQUALS || key == SDLK_KP_PLUS)
 	{
-		auto size = rayTracer.getSize();
-		size <<= 1;
-		if (size > 2048)
-			size = 2048;
-		rayTracer.setSize(size);
+		// Only as large as the texture can be, bigger images are for the command line tool
+		GLint maximumSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maximumSize);
+		if (std::max(rayTracer.getWidth(), rayTracer.getHeight()) * 2 <= maximumSize)
+			rayTracer.setSize(rayTracer.getWidth() << 1, rayTracer.getHeight() << 1);
 	}
 
 	if (key == SDLK_PRINTSCREEN)
@@ -105,7 +240,19 @@ void initialise()
 	glEnable(GL_TEXTURE_2D);
 	glClearColor(0, 0, 0, 1);
 
-	loadSceneJson(&rayTracer, "scene8.json");
+	glGenBuffersFunction = reinterpret_cast<PFNGLGENBUFFERSPROC>(SDL_GL_GetProcAddress("glGenBuffers"));
+	glBindBufferFunction = reinterpret_cast<PFNGLBINDBUFFERPROC>(SDL_GL_GetProcAddress("glBindBuffer"));
+	glBufferDataFunction = reinterpret_cast<PFNGLBUFFERDATAPROC>(SDL_GL_GetProcAddress("glBufferData"));
+	glMapBufferFunction = reinterpret_cast<PFNGLMAPBUFFERPROC>(SDL_GL_GetProcAddress("glMapBuffer"));
+	glUnmapBufferFunction = reinterpret_cast<PFNGLUNMAPBUFFERPROC>(SDL_GL_GetProcAddress("glUnmapBuffer"));
+	if (glGenBuffersFunction == nullptr || glBindBufferFunction == nullptr || glBufferDataFunction == nullptr || glMapBufferFunction == nullptr || glUnmapBufferFunction == nullptr)
+	{
+		printf("OpenGL 2.1 pixel buffer objects are not supported!\n");
+		exit(-3);
+	}
+	glGenBuffersFunction(1, &pixelBuffer);
+
+	loadSceneJson(&rayTracer, SCENE_FILE);
 }
 
 int main(int, char*[])
@@ -133,11 +280,19 @@ int main(int, char*[])
 	initialise();
 
 	auto quit = false;
+	auto changing = true;
 	while (!quit)
 	{
 		SDL_Event event;
-		while (SDL_PollEvent(&event) != 0)
+		auto haveEvent = false;
+
+		// Nothing on screen changes without input once the image is finished, so sleep until some arrives
+		if (!changing)
+			haveEvent = SDL_WaitEvent(&event) != 0;
+
+		while (haveEvent || SDL_PollEvent(&event) != 0)
 		{
+			haveEvent = false;
 			if (event.type == SDL_QUIT)
 			{
 				quit = true;
@@ -148,7 +303,7 @@ int main(int, char*[])
 			}
 		}
 
-		display();
+		changing = display();
 		SDL_GL_SwapWindow(window);
 	}
 
@@ -0,0 +1,391 @@
+#include "Torus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+#include "MathsHelper.h"
+#include "SolidMaterial.h"
+
+static constexpr float MAJOR_RADIUS = 3;
+static constexpr float MINOR_RADIUS = 1;
+// Step of the brute force search for the first sign change along a ray
+static constexpr double SCAN_STEP = 1.0e-3;
+// Hits further apart than this from the brute force one count as wrong
+static constexpr float DISTANCE_TOLERANCE = 1.0e-3f;
+static constexpr int REPEATS = 5;
+
+namespace
+{
+	// The closed form solver Torus used before, kept here to compare against
+	bool solveQuadratic(float a, float b, float c, float& root)
+	{
+		if (a == 0.0 || fabs(a / b) < 1.0e-6f)
+		{
+			if (fabs(b) < 1.0e-4f)
+				return false;
+
+			root = -c / b;
+			return true;
+		}
+
+		auto discriminant = b * b - 4 * a * c;
+		if (discriminant >= 0)
+		{
+			discriminant = sqrtf(discriminant);
+			root = (b + discriminant) * -0.5f / a;
+			return true;
+		}
+
+		return false;
+	}
+
+	bool solveCubic(float a, float b, float c, float d, float& root)
+	{
+		if (a == 0 || fabs(a / b) < 1.0e-6f)
+			return solveQuadratic(b, c, d, root);
+
+		const auto B = b / a, C = c / a, D = d / a;
+
+		const auto Q = (B * B - C * 3) / 9;
+		const auto QQQ = Q * Q * Q;
+		const auto R = (2 * B * B * B - 9 * B * C + 27 * D) / 54;
+		const auto RR = R * R;
+
+		if (RR < QQQ)
+		{
+			const auto theta = acosf(R / sqrtf(QQQ));
+			auto r1 = -2 * sqrtf(Q);
+			auto r2 = r1;
+			auto r3 = r1;
+			r1 *= cosf(theta / 3);
+			r2 *= cosf((theta + 2 * PI) / 3);
+			r3 *= cosf((theta - 2 * PI) / 3);
+
+			r1 -= B / 3;
+			r2 -= B / 3;
+			r3 -= B / 3;
+
+			root = 1000000;
+
+			if (r1 >= 0) root = r1;
+			if (r2 >= 0 && r2 < root) root = r2;
+			if (r3 >= 0 && r3 < root) root = r3;
+
+			return true;
+		}
+
+		// The original left root unset when A2 is zero, where the A2 + Q / A2 term it drops would be zero
+		root = 0;
+		auto A2 = -powf(fabs(c) + sqrtf(RR - QQQ), 1.0f / 3.0f);
+		if (A2 != 0)
+		{
+			if (R < 0)
+				A2 = -A2;
+			root = A2 + Q / A2;
+		}
+		root -= B / 3;
+		return true;
+	}
+
+	bool solveQuartic(float a, float b, float c, float d, float e, float& root)
+	{
+		if (a == 0 || fabs(a / b) < 1.0e-6f || fabs(a / c) < 1.0e-6f)
+			return solveCubic(b, c, d, e, root);
+
+		const auto aa = a * a;
+		const auto aaa = aa * a;
+		const auto bb = b * b;
+		const auto bbb = bb * b;
+		const auto alpha = -3 * bb / (8 * aa) + c / a;
+		const auto alpha2 = alpha * alpha;
+		const auto beta = bbb / (8 * aaa) + b * c / (-2 * aa) + d / a;
+		const auto gamma = -3 * bbb * b / (256 * aaa * a) + c * bb / (16 * aaa) + b * d / (-4 * aa) + e / a;
+
+		if (beta == 0)
+		{
+			root = b / (-4 * a) + sqrtf(0.5f * (-alpha + sqrtf(alpha2 + 4 * gamma)));
+			return true;
+		}
+
+		const std::complex<float> P = -alpha2 / 12 - gamma;
+		const std::complex<float> Q = -alpha2 * alpha / 108 + alpha * gamma / 3 - beta * beta / 8;
+		const auto R = Q * 0.5f + sqrt(Q * Q * 0.25f + P * P * P / 27.0f);
+		const auto U = pow(R, 1.0f / 3.0f);
+		auto y = -5 * alpha / 6 - U;
+		if (U != 0.0f)
+			y += P / (3.0f * U);
+		const auto W = sqrt(alpha + y + y);
+
+		auto foundRealRoot = false;
+
+		const auto firstPart = b / (-4 * a);
+		const auto secondPart = -3 * alpha - 2.0f * y;
+		const auto thirdPart = 2.0f * beta / W;
+
+		const std::complex<float> roots[4] =
+		{
+			firstPart + 0.5f * (-W - sqrt(secondPart + thirdPart)),
+			firstPart + 0.5f * (-W + sqrt(secondPart + thirdPart)),
+			firstPart + 0.5f * (W - sqrt(secondPart - thirdPart)),
+			firstPart + 0.5f * (W + sqrt(secondPart - thirdPart)),
+		};
+
+		for (const auto& aRoot : roots)
+		{
+			if (fabs(aRoot.imag()) < 1.0e-10f && aRoot.real() >= 0 && (!foundRealRoot || aRoot.real() < root))
+			{
+				root = aRoot.real();
+				foundRealRoot = true;
+			}
+		}
+
+		return foundRealRoot;
+	}
+
+	// The old intersect also mixed the world and torus frames in its coefficients, which is fixed here so only the solvers differ
+	bool intersectFerrari(const Ray& ray, float& distance)
+	{
+		const auto& origin = ray.position;
+		const auto& direction = ray.direction;
+		const auto majorSquared = MAJOR_RADIUS * MAJOR_RADIUS;
+
+		const auto a = lengthSquared(direction);
+		const auto b = 2 * dot(direction, origin);
+		const auto c = lengthSquared(origin) + majorSquared - MINOR_RADIUS * MINOR_RADIUS;
+
+		auto root = 0.0f;
+		const auto found = solveQuartic(a * a, 2 * a * b,
+			b * b + 2 * a * c - 4 * majorSquared * (direction.x * direction.x + direction.y * direction.y),
+			2 * b * c - 8 * majorSquared * (origin.x * direction.x + origin.y * direction.y),
+			c * c - 4 * majorSquared * (origin.x * origin.x + origin.y * origin.y), root);
+
+		if (!found || root < 0)
+			return false;
+
+		distance = root;
+		return true;
+	}
+
+	double implicit(double x, double y, double z)
+	{
+		const auto k = x * x + y * y + z * z + MAJOR_RADIUS * MAJOR_RADIUS - MINOR_RADIUS * MINOR_RADIUS;
+		return k * k - 4 * MAJOR_RADIUS * MAJOR_RADIUS * (x * x + y * y);
+	}
+
+	double implicitAlong(const Ray& ray, double distance)
+	{
+		return implicit(ray.position.x + ray.direction.x * distance, ray.position.y + ray.direction.y * distance, ray.position.z + ray.direction.z * distance);
+	}
+
+	// Derivative of implicitAlong, the gradient of the implicit surface dotted with the direction
+	double slopeAlong(const Ray& ray, double distance)
+	{
+		const auto x = ray.position.x + ray.direction.x * distance;
+		const auto y = ray.position.y + ray.direction.y * distance;
+		const auto z = ray.position.z + ray.direction.z * distance;
+		const auto k = x * x + y * y + z * z + MAJOR_RADIUS * MAJOR_RADIUS - MINOR_RADIUS * MINOR_RADIUS;
+		const auto ring = 2 * MAJOR_RADIUS * MAJOR_RADIUS;
+		return 4 * ((k - ring) * (x * ray.direction.x + y * ray.direction.y) + k * z * ray.direction.z);
+	}
+
+	// Point in [low, high] where the sign of value changes, bisecting for as long as double precision allows
+	template<typename Function>
+	double bisect(Function&& value, double low, double high)
+	{
+		const auto lowNegative = value(low) < 0;
+		for (auto i = 0; i < 60; i++)
+		{
+			const auto middle = (low + high) / 2;
+			if ((value(middle) < 0) == lowNegative)
+				low = middle;
+			else high = middle;
+		}
+		return (low + high) / 2;
+	}
+
+	// First root along the ray inside the bounding sphere, found in small steps. Steps with no sign change are also
+	// checked at their lowest point, so rays that only graze the tube within one step are not missed
+	bool intersectBruteForce(const Ray& ray, double& distance)
+	{
+		const auto outerRadius = static_cast<double>(MAJOR_RADIUS + MINOR_RADIUS);
+		const double b = dot(ray.direction, ray.position);
+		const double c = lengthSquared(ray.position) - outerRadius * outerRadius;
+		if (b * b - c <= 0)
+			return false;
+
+		auto value = [&ray](double t) { return implicitAlong(ray, t); };
+		auto slope = [&ray](double t) { return slopeAlong(ray, t); };
+
+		// Starts a step outside, the outer edge of the tube touches the sphere
+		const auto far = -b + sqrt(b * b - c);
+		for (auto low = std::max(-b - sqrt(b * b - c) - SCAN_STEP, 1.0e-4); low < far; low += SCAN_STEP)
+		{
+			const auto high = low + SCAN_STEP;
+			const auto lowNegative = value(low) < 0;
+			if ((value(high) < 0) != lowNegative)
+			{
+				distance = bisect(value, low, high);
+				return true;
+			}
+
+			if (lowNegative || !(slope(low) < 0 && slope(high) > 0))
+				continue;
+
+			const auto lowest = bisect(slope, low, high);
+			if (value(lowest) < 0)
+			{
+				distance = bisect(value, low, lowest);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Normalised gradient of the implicit surface, by central differences
+	vec4 numericalNormal(const vec4& point)
+	{
+		const auto step = 1.0e-5;
+		const auto x = implicit(point.x + step, point.y, point.z) - implicit(point.x - step, point.y, point.z);
+		const auto y = implicit(point.x, point.y + step, point.z) - implicit(point.x, point.y - step, point.z);
+		const auto z = implicit(point.x, point.y, point.z + step) - implicit(point.x, point.y, point.z - step);
+		const auto length = sqrt(x * x + y * y + z * z);
+		return vec4{ static_cast<float>(x / length), static_cast<float>(y / length), static_cast<float>(z / length), 0 };
+	}
+
+	struct Accuracy
+	{
+		int hits;
+		int wrong;
+		float maxDistanceError;
+		float maxNormalError;
+	};
+
+	template<typename Intersect, typename Normal>
+	Accuracy measureAccuracy(const std::vector<Ray>& rays, const std::vector<double>& references, Intersect&& intersect, Normal&& normal)
+	{
+		Accuracy accuracy{};
+		for (auto i = 0u; i < rays.size(); i++)
+		{
+			float distance;
+			const auto hit = intersect(rays[i], distance);
+			const auto expected = references[i] >= 0;
+			accuracy.hits += hit;
+
+			if (hit != expected || (hit && fabs(distance - references[i]) > DISTANCE_TOLERANCE))
+			{
+				accuracy.wrong++;
+				continue;
+			}
+
+			if (!hit)
+				continue;
+
+			const auto point = rays[i].calculatePoint(static_cast<float>(references[i]));
+			accuracy.maxDistanceError = std::max(accuracy.maxDistanceError, static_cast<float>(fabs(distance - references[i])));
+			accuracy.maxNormalError = std::max(accuracy.maxNormalError, length(normal(rays[i], distance) - numericalNormal(point)));
+		}
+
+		return accuracy;
+	}
+
+	// Best time of a few passes over every ray, in nanoseconds per ray
+	template<typename Intersect>
+	double measureTime(const std::vector<Ray>& rays, Intersect&& intersect)
+	{
+		auto best = std::numeric_limits<double>::infinity();
+		auto sum = 0.0f;
+		for (auto repeat = 0; repeat < REPEATS; repeat++)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			for (const auto& ray : rays)
+			{
+				float distance;
+				if (intersect(ray, distance))
+					sum += distance;
+			}
+			const auto end = std::chrono::high_resolution_clock::now();
+			best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / rays.size());
+		}
+
+		// Keeps the loop from being optimised away
+		if (sum == -1)
+			printf("\n");
+		return best;
+	}
+
+	void printResult(const char* name, double time, const Accuracy& accuracy, int checked)
+	{
+		printf("%-10s %8.1f ns/ray %8d hits %8d wrong of %d, max distance error %g, max normal error %g\n",
+		       name, time, accuracy.hits, accuracy.wrong, checked, accuracy.maxDistanceError, accuracy.maxNormalError);
+	}
+}
+
+// Times Torus::intersect against the closed form solver it replaced, on the same random rays,
+// and checks both against a brute force search along each ray
+int main(int argc, char* argv[])
+{
+	auto rayCount = 200000;
+	if (argc > 1)
+		rayCount = atoi(argv[1]);
+	if (rayCount <= 0)
+	{
+		printf("Usage: %s [ray count]\n", argv[0]);
+		return 1;
+	}
+
+	const Torus torus{ vec4{}, MAJOR_RADIUS, MINOR_RADIUS, std::make_unique<SolidMaterial>(vec4{ 1 }, 0.0f, 0.0f, 0.0f) };
+
+	// Rays from around the torus towards points in its bounds, so most of them hit
+	std::mt19937 generator{ 1 };
+	std::uniform_real_distribution<float> distribution{ -1, 1 };
+	std::vector<Ray> rays{};
+	rays.reserve(rayCount);
+	for (auto i = 0; i < rayCount; i++)
+	{
+		const auto origin = vec4{ distribution(generator) * 10, distribution(generator) * 10, distribution(generator) * 10, 0 };
+		const auto outer = MAJOR_RADIUS + MINOR_RADIUS;
+		const auto target = vec4{ distribution(generator) * outer, distribution(generator) * outer, distribution(generator) * MINOR_RADIUS, 0 };
+		rays.push_back(Ray{ origin, normalise(target - origin) });
+	}
+
+	std::vector<double> references(rays.size());
+	for (auto i = 0u; i < rays.size(); i++)
+	{
+		if (!intersectBruteForce(rays[i], references[i]))
+			references[i] = -1;
+	}
+
+	auto ferrari = [](const Ray& ray, float& distance)
+	{
+		return intersectFerrari(ray, distance);
+	};
+	auto bracketed = [&torus](const Ray& ray, float& distance)
+	{
+		auto primitive = 0;
+		return torus.intersect(ray, distance, primitive);
+	};
+
+	// The old Torus had a constant normal, so the Ferrari hits are given the gradient at the point they found
+	auto ferrariNormal = [](const Ray& ray, float distance)
+	{
+		return numericalNormal(ray.calculatePoint(distance));
+	};
+	auto bracketedNormal = [&torus](const Ray& ray, float distance)
+	{
+		IntersectionResult result{};
+		torus.calculateSurface(ray, distance, 0, result);
+		return result.normal;
+	};
+
+	printf("Torus R=%g r=%g, %d rays, %d hit by brute force\n", MAJOR_RADIUS, MINOR_RADIUS, rayCount,
+	       static_cast<int>(std::count_if(references.begin(), references.end(), [](double distance) { return distance >= 0; })));
+	printResult("Ferrari", measureTime(rays, ferrari), measureAccuracy(rays, references, ferrari, ferrariNormal), rayCount);
+	printResult("Bracketed", measureTime(rays, bracketed), measureAccuracy(rays, references, bracketed, bracketedNormal), rayCount);
+	return 0;
+}